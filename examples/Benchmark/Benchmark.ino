@@ -0,0 +1,173 @@
+/**
+ * Benchmark.ino
+ *
+ * Measures the hot path of RLNode without a network or backend. The node is connected
+ * to an RLDataAccessSimulator that answers the MQTT traffic and the dataaccess requests
+ * without delay, with the channel configurations from onConfiguration below. Runs on any
+ * board with enough RAM, and on a development machine through the host build in extras/host.
+ *
+ * Reports, for each scenario:
+ *   - loop() iteration latency (min/mean/max in microseconds)
+ *   - publishes per second for each channel
+ *   - bytes sent to the client per publish, heap growth per publish (AVR and ARM only)
+ *     and bytes allocated per publish (host build only)
+ *
+ * Owned by: RealTest AB
+ */
+
+// Requests are answered at once, few answers wait at a time
+#define SIMULATOR_MAX_PENDING 8
+
+#include <RLNode.h>
+#include <RLDataAccessSimulator.h>
+#include <RLMemory.h>
+
+#define BENCHMARK_TIME 10000  // Duration of each scenario in ms
+#define BENCHMARK_CHANNELS 4
+#define BENCHMARK_MAC "BE0C4A000001"
+
+RLDataAccessSimulator client;
+const float sampleRates[BENCHMARK_CHANNELS] = {1, 10, 100, 1000};
+const int batchSizes[] = {1, MAX_BATCH_SIZE};  // One scenario per batch size
+int batchSize = 1;
+unsigned long channelMessages[BENCHMARK_CHANNELS];
+
+// Sensor function, cheap so the library overhead is what gets measured
+void readSensor(char* outputString, float k, float m, bool* forcePublish)
+{
+    intTochar(micros() % 1000, outputString);
+}
+
+RLChannel channel1("Benchmark", 1000, readSensor);
+RLChannel channel2("Benchmark", 1000, readSensor);
+RLChannel channel3("Benchmark", 1000, readSensor);
+RLChannel channel4("Benchmark", 1000, readSensor);
+
+// Counts the samples of each channel, published on bench/<ChannelId>
+void onPublish(const char* topic, const uint8_t* payload, unsigned int length)
+{
+    if (strncmp(topic, "bench/", 6))
+        return;
+    int channel = atoi(topic + 6) - 1;
+    if (channel >= 0 && channel < BENCHMARK_CHANNELS)
+        channelMessages[channel]++;
+}
+
+// Channel configurations handed out by the simulated dataaccess
+void onConfiguration(JsonObject configuration, const char* mac, int channelId)
+{
+    char publishTopic[16] = "bench/";
+    intTochar(channelId, publishTopic + 6);
+    configuration["PublishTopic"] = publishTopic;
+    configuration["SampleRate"] = sampleRates[(channelId - 1) % BENCHMARK_CHANNELS];
+    configuration["BatchSize"] = batchSize;
+}
+
+// Run the node until the configuration requests are answered and the channels are publishing
+void configure()
+{
+    logNode.loop();
+    while (logNode.requestsPending())
+    {
+        logNode.loop();
+    }
+    unsigned long start = millis();
+    while (millis() - start < CHANNEL_ACTIVATION_DELAY + 100)
+    {
+        logNode.loop();
+    }
+}
+
+void runScenario()
+{
+    unsigned long loops = 0;
+    unsigned long total = 0;
+    unsigned long fastest = 0xFFFFFFFF;
+    unsigned long slowest = 0;
+
+    memset(channelMessages, 0, sizeof(channelMessages));
+    client.resetCounters();
+    long memoryBefore = freeMemory();
+    long allocatedBefore = allocatedMemory();
+    unsigned long start = millis();
+    while (millis() - start < BENCHMARK_TIME)
+    {
+        unsigned long t = micros();
+        logNode.loop();
+        t = micros() - t;
+        total += t;
+        loops++;
+        if (t < fastest)
+            fastest = t;
+        if (t > slowest)
+            slowest = t;
+    }
+    long memoryAfter = freeMemory();
+    long allocatedAfter = allocatedMemory();
+
+    Serial.println();
+    Serial.print(F("Scenario: batch size "));
+    Serial.println(batchSize);
+    Serial.print(F("  loop() [us] min/mean/max: "));
+    Serial.print(fastest);
+    Serial.print(F("/"));
+    Serial.print(total / loops);
+    Serial.print(F("/"));
+    Serial.println(slowest);
+    for (int i = 0; i < BENCHMARK_CHANNELS; i++)
+    {
+        Serial.print(F("  Channel "));
+        Serial.print(i + 1);
+        Serial.print(F(" at "));
+        Serial.print(sampleRates[i]);
+        Serial.print(F(" Hz: "));
+        Serial.print(channelMessages[i] * 1000.0 / BENCHMARK_TIME);
+        Serial.println(F(" publishes/s"));
+    }
+    if (client.Publishes > 0)
+    {
+        Serial.print(F("  Bytes sent per publish: "));
+        Serial.println(client.PublishBytes / client.Publishes);
+        if (memoryBefore >= 0)
+        {
+            Serial.print(F("  Heap growth per publish: "));
+            Serial.println((float)(memoryBefore - memoryAfter) / client.Publishes);
+        }
+        if (allocatedBefore >= 0)
+        {
+            Serial.print(F("  Bytes allocated per publish: "));
+            Serial.println((float)(allocatedAfter - allocatedBefore) / client.Publishes);
+        }
+    }
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial) {}
+
+    client.setPublishHandler(onPublish);
+    client.setConfigurationHandler(onConfiguration);
+    logNode.addChannel(&channel1);
+    logNode.addChannel(&channel2);
+    logNode.addChannel(&channel3);
+    logNode.addChannel(&channel4);
+    logNode.setPipelinedRequests(true);
+    logNode.begin(client, BENCHMARK_MAC, "loopback", 1883);
+
+    for (unsigned int i = 0; i < sizeof(batchSizes) / sizeof(batchSizes[0]); i++)
+    {
+        // Reconfigure the channels through the configuration changed notification
+        batchSize = batchSizes[i];
+        if (i > 0)
+            client.inject("not/" BENCHMARK_MAC "/configuration", "{}");
+        configure();
+        runScenario();
+    }
+    Serial.println();
+    Serial.println(F("Benchmark done"));
+}
+
+void loop()
+{
+}
@@ -0,0 +1,261 @@
+/**
+ * DataAccessSimulator.ino
+ *
+ * Tests the startup and configuration protocol of RLNode against RLDataAccessSimulator,
+ * a local stand-in for the broker and dataaccess with latency, reordering, lost answers
+ * and "Processing" answers. Runs without a network.
+ *
+ * For 1 to MAX_CHANNEL_COUNT channels, a new node is started and measured:
+ *   - time from begin() until the startup requests are done, and until every channel has published
+ *   - reply time of an identification poll
+ *   - time from a pushed setchannelconfiguration until the channel publishes with the new configuration,
+ *     and that the other channels keep their publish topic and sample rate
+ *   - time from a configuration notification until every channel publishes with the new configuration
+ * A last scenario with MAX_CHANNEL_COUNT channels loses HARNESS_LOSS_PERCENT of the answers, with
+ * short request timeouts so the node resends them within the scenario.
+ * A scenario that does not finish within HARNESS_TIMEOUT fails, the result is printed last.
+ *
+ * Owned by: RealTest AB
+ */
+
+#define LOOPBACK_MAX_SUBSCRIPTIONS 16
+
+#include <RLNode.h>
+#include <RLDataAccessSimulator.h>
+
+#define HARNESS_MAC "5140DA000001"
+#define HARNESS_TIMEOUT 60000  // Max time in ms of each step
+#define HARNESS_LATENCY 50
+#define HARNESS_JITTER 100
+#define HARNESS_REORDER_PERCENT 20
+#define HARNESS_PROCESSING_PERCENT 20
+#define HARNESS_PROCESSING_DELAY 200
+#define HARNESS_LOSS_PERCENT 20  // Answers lost in the loss scenario
+#define HARNESS_RESPONSE_TIMEOUT 1000  // Request timeouts of the loss scenario, longer than the slowest answer
+#define HARNESS_RETRY_DELAY 200
+#define HARNESS_CHECK_TIME 2000  // Time in ms the other channels are checked after a channel reconfiguration
+#define HARNESS_RATE_TOLERANCE 25  // Deviation in percent from the configured sample rate that passes
+
+RLDataAccessSimulator client;
+RLNode* node = NULL;
+RLChannel* channels[MAX_CHANNEL_COUNT];
+unsigned long firstSample[MAX_CHANNEL_COUNT];  // Time of the first sample with the latest configuration, 0 if none
+unsigned long samples[MAX_CHANNEL_COUNT];
+unsigned long otherSamples[MAX_CHANNEL_COUNT];  // Samples with another generation than expectedGeneration
+unsigned int expectedGeneration[MAX_CHANNEL_COUNT];
+unsigned long startupTime = 0;
+bool passed = true;
+
+int32_t readSensor(bool* forcePublish)
+{
+    return millis() % 1000;
+}
+
+void onStartup(int result)
+{
+    startupTime = millis();
+}
+
+// Samples are published on sim/<MAC>/<ChannelId>/<Generation>
+void onPublish(const char* topic, const uint8_t* payload, unsigned int length)
+{
+    if (strncmp(topic, "sim/" HARNESS_MAC "/", 17))
+        return;
+    const char* generation = strchr(topic + 17, '/');
+    int channel = atoi(topic + 17) - 1;
+    if (generation == NULL || channel < 0 || channel >= MAX_CHANNEL_COUNT)
+        return;
+    unsigned int sampleGeneration = atoi(generation + 1);
+    samples[channel]++;
+    if (sampleGeneration != expectedGeneration[channel])
+        otherSamples[channel]++;
+    if (sampleGeneration == client.Generation && firstSample[channel] == 0)
+        firstSample[channel] = millis();
+}
+
+bool sampled(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (firstSample[i] == 0)
+            return false;
+    }
+    return true;
+}
+
+// Time in ms from start until every one of the first count channels has published, 0 if one has not
+unsigned long sampleLatency(int count, unsigned long start)
+{
+    unsigned long latest = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (firstSample[i] == 0)
+            return 0;
+        if (firstSample[i] - start > latest)
+            latest = firstSample[i] - start;
+    }
+    return latest;
+}
+
+// Run the node for HARNESS_CHECK_TIME and check that the channels with index first up to count
+// only publish on their topic of generation, at the configured sample rate
+bool unchanged(int first, int count, unsigned int generation)
+{
+    for (int i = first; i < count; i++)
+    {
+        expectedGeneration[i] = generation;
+        samples[i] = 0;
+        otherSamples[i] = 0;
+    }
+    unsigned long start = millis();
+    while (millis() - start < HARNESS_CHECK_TIME)
+        node->loop();
+
+    float expected = client.SampleRate * HARNESS_CHECK_TIME / 1000;
+    for (int i = first; i < count; i++)
+    {
+        if (otherSamples[i] > 0 || samples[i] < expected * (100 - HARNESS_RATE_TOLERANCE) / 100 ||
+            samples[i] > expected * (100 + HARNESS_RATE_TOLERANCE) / 100)
+            return false;
+    }
+    return true;
+}
+
+// Run the node until done returns true, false if HARNESS_TIMEOUT passes first
+bool runUntil(bool (*done)(int count), int count)
+{
+    unsigned long start = millis();
+    while (!done(count))
+    {
+        if (millis() - start >= HARNESS_TIMEOUT)
+        {
+            passed = false;
+            return false;
+        }
+        node->loop();
+    }
+    return true;
+}
+
+bool startupDone(int count) { return startupTime != 0 && sampled(count); }
+bool commandDone(int count) { return client.CommandReplies > 0 && sampled(count); }
+
+void printResult(const __FlashStringHelper* name, bool done, unsigned long time)
+{
+    Serial.print(name);
+    if (done)
+    {
+        Serial.print(time);
+        Serial.println(F(" ms"));
+    }
+    else
+        Serial.println(F("[Timeout]"));
+}
+
+void runScenario(int count, uint8_t lossPercent)
+{
+    // Every scenario starts with a new node and a new connection
+    client.drop();
+    client.resetSimulator();
+    client.LossPercent = lossPercent;
+    memset(firstSample, 0, sizeof(firstSample));
+    startupTime = 0;
+    node = new RLNode();
+    for (int i = 0; i < count; i++)
+    {
+        channels[i] = new RLChannel("Simulated", 1000, readSensor);
+        node->addChannel(channels[i]);
+    }
+    node->setPipelinedRequests(true);
+    node->setStartupCallback(onStartup);
+    if (lossPercent > 0)
+        node->setRequestTimeouts(HARNESS_RESPONSE_TIMEOUT, HARNESS_RETRY_DELAY);
+
+    Serial.println();
+    Serial.print(F("Scenario: "));
+    Serial.print(count);
+    Serial.print(F(" channels"));
+    if (lossPercent > 0)
+    {
+        Serial.print(F(", "));
+        Serial.print(lossPercent);
+        Serial.print(F("% of the answers lost"));
+    }
+    Serial.println();
+
+    unsigned long start = millis();
+    node->begin(client, HARNESS_MAC, "simulator", 1883);
+    bool done = runUntil(startupDone, count);
+    printResult(F("  Startup requests done: "), startupTime != 0, startupTime - start);
+    printResult(F("  Time to first sample: "), done, sampleLatency(count, start));
+
+    client.CommandReplies = 0;
+    client.identificationPoll();
+    done = runUntil(commandDone, 0);
+    printResult(F("  Identification poll reply: "), done, client.CommandLatency);
+
+    // One channel through setchannelconfiguration, the other channels are not reconfigured
+    client.CommandReplies = 0;
+    memset(firstSample, 0, sizeof(firstSample));
+    unsigned int generation = client.Generation;
+    client.setChannelConfiguration(HARNESS_MAC, 1, client.SampleRate * 2);
+    done = runUntil(commandDone, 1) && !strcmp(client.CommandStatus, "Done");
+    passed = passed && done;
+    printResult(F("  Channel reconfiguration reply: "), done, client.CommandLatency);
+    printResult(F("  Channel reconfiguration to first sample: "), done, sampleLatency(1, client.CommandTime));
+    if (count > 1)
+    {
+        done = unchanged(1, count, generation);
+        passed = passed && done;
+        Serial.print(F("  Other channels unchanged: "));
+        Serial.println(done ? F("[Passed]") : F("[Failed]"));
+    }
+
+    // All channels through the configuration notification
+    memset(firstSample, 0, sizeof(firstSample));
+    client.configurationChanged(HARNESS_MAC);
+    unsigned long notified = client.CommandTime;
+    done = runUntil(sampled, count);
+    printResult(F("  Node reconfiguration to first sample: "), done, sampleLatency(count, notified));
+
+    Serial.print(F("  Requests/answers/lost/reordered/processing: "));
+    Serial.print(client.Requests);
+    Serial.print(F("/"));
+    Serial.print(client.Answers);
+    Serial.print(F("/"));
+    Serial.print(client.Lost);
+    Serial.print(F("/"));
+    Serial.print(client.Reordered);
+    Serial.print(F("/"));
+    Serial.println(client.Processing);
+
+    delete node;
+    node = NULL;
+    for (int i = 0; i < count; i++)
+        delete channels[i];
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial) {}
+
+    client.setPublishHandler(onPublish);
+    client.Latency = HARNESS_LATENCY;
+    client.Jitter = HARNESS_JITTER;
+    client.ReorderPercent = HARNESS_REORDER_PERCENT;
+    client.ProcessingPercent = HARNESS_PROCESSING_PERCENT;
+    client.ProcessingDelay = HARNESS_PROCESSING_DELAY;
+    client.SampleRate = 10;
+
+    for (int count = 1; count <= MAX_CHANNEL_COUNT; count++)
+        runScenario(count, 0);
+    runScenario(MAX_CHANNEL_COUNT, HARNESS_LOSS_PERCENT);
+
+    Serial.println();
+    Serial.println(passed ? F("Simulator harness [Passed]") : F("Simulator harness [Failed]"));
+}
+
+void loop()
+{
+}
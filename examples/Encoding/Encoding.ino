@@ -0,0 +1,149 @@
+/**
+ * Encoding.ino
+ *
+ * Compares the text and binary sample encodings on series of channel values, without a network.
+ * The series are encoded in messages of MAX_BATCH_SIZE samples like a batched channel publishes them,
+ * decoded with the reference decoder, and checked to give back the same numeric values.
+ *
+ * Reports, for each series:
+ *   - bytes per message and per sample for both encodings, and the compression ratio
+ *   - time to encode and decode a message in microseconds
+ *
+ * The series below are example values in the format the sensor functions produce,
+ * replace them with values recorded from your own channels.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include <RLNode.h>
+
+#define SERIES_LENGTH 64
+
+// Room temperature at 1 Hz, 2 decimals
+const char* temperature[SERIES_LENGTH] = {
+    "21.80", "21.80", "21.81", "21.79", "21.78", "21.77", "21.78", "21.80", "21.79", "21.79",
+    "21.81", "21.80", "21.82", "21.82", "21.81", "21.80", "21.81", "21.82", "21.81", "21.81",
+    "21.80", "21.82", "21.83", "21.82", "21.83", "21.85", "21.84", "21.84", "21.82", "21.80",
+    "21.82", "21.81", "21.83", "21.85", "21.86", "21.85", "21.85", "21.84", "21.86", "21.87",
+    "21.87", "21.87", "21.88", "21.88", "21.90", "21.89", "21.91", "21.91", "21.93", "21.94",
+    "21.92", "21.92", "21.91", "21.93", "21.95", "21.93", "21.93", "21.93", "21.92", "21.94",
+    "21.92", "21.91", "21.93", "21.92"
+};
+
+// Vibration at 100 Hz, 3 decimals
+const char* vibration[SERIES_LENGTH] = {
+    "0.012", "0.626", "0.782", "0.370", "-0.357", "-0.740", "-0.632", "-0.012", "0.603", "0.804",
+    "0.288", "-0.386", "-0.785", "-0.625", "0.022", "0.654", "0.730", "0.319", "-0.411", "-0.803",
+    "-0.557", "0.033", "0.697", "0.727", "0.311", "-0.361", "-0.758", "-0.608", "0.039", "0.658",
+    "0.795", "0.249", "-0.442", "-0.815", "-0.563", "0.024", "0.689", "0.742", "0.288", "-0.395",
+    "-0.799", "-0.552", "0.119", "0.658", "0.801", "0.253", "-0.413", "-0.796", "-0.592", "0.073",
+    "0.705", "0.742", "0.296", "-0.436", "-0.830", "-0.564", "0.085", "0.651", "0.741", "0.247",
+    "-0.426", "-0.749", "-0.526", "0.109"
+};
+
+// True if decoded is value with zeros added to get the decimals of the message, "-0" is decoded as "0"
+bool sameValue(const char* value, const char* decoded)
+{
+    if (*value == '-' && *decoded != '-' && strspn(value + 1, "0.") == strlen(value + 1))
+        value++;
+    size_t length = strlen(value);
+    if (strncmp(value, decoded, length))
+        return false;
+    decoded += length;
+    if (*decoded == '.' && strchr(value, '.') == NULL)
+        decoded++;
+    while (*decoded == '0')
+        decoded++;
+    return *decoded == '\0';
+}
+
+void runSeries(const char* name, const char* const* series, unsigned long period)
+{
+    RLSample samples[MAX_BATCH_SIZE];
+    char text[MAX_BATCH_PAYLOAD_SIZE];
+    uint8_t binary[MAX_BINARY_PAYLOAD_SIZE];
+    unsigned long textBytes = 0;
+    unsigned long binaryBytes = 0;
+    unsigned long encodeTime = 0;
+    unsigned long decodeTime = 0;
+    unsigned long messages = 0;
+    unsigned long errors = 0;
+    unsigned long start = millis();
+
+    for (int first = 0; first + MAX_BATCH_SIZE <= SERIES_LENGTH; first += MAX_BATCH_SIZE)
+    {
+        for (int i = 0; i < MAX_BATCH_SIZE; i++)
+        {
+            samples[i].Time = start + (first + i) * period;
+            strcpy(samples[i].Value, series[first + i]);
+        }
+
+        beginSampleMessage(text, samples[0].Time, logNode);
+        for (int i = 0; i < MAX_BATCH_SIZE; i++)
+            appendSampleMessage(text, samples[i], samples[0].Time, i == 0);
+        endSampleMessage(text);
+        textBytes += strlen(text);
+
+        unsigned long t = micros();
+        size_t length = encodeSampleMessage(binary, sizeof(binary), samples, MAX_BATCH_SIZE, logNode);
+        encodeTime += micros() - t;
+        binaryBytes += length;
+        messages++;
+
+        // Decode and compare with the values and times that were encoded
+        t = micros();
+        RLBinaryDecoder decoder(binary, length);
+        int count = 0;
+        unsigned long offset;
+        int64_t value;
+        char decoded[24];
+        if (!decoder.begin())
+            errors++;
+        while (decoder.next(offset, value))
+        {
+            RLBinaryDecoder::format(value, decoder.Decimals, decoded);
+            if (count >= MAX_BATCH_SIZE || !sameValue(samples[count].Value, decoded) ||
+                offset != samples[count].Time - samples[0].Time)
+                errors++;
+            count++;
+        }
+        decodeTime += micros() - t;
+        if (count != MAX_BATCH_SIZE || decoder.Error)
+            errors++;
+    }
+
+    Serial.println();
+    Serial.print(F("Series: "));
+    Serial.println(name);
+    Serial.print(F("  Text bytes per message/sample: "));
+    Serial.print((float)textBytes / messages);
+    Serial.print(F("/"));
+    Serial.println((float)textBytes / (messages * MAX_BATCH_SIZE));
+    Serial.print(F("  Binary bytes per message/sample: "));
+    Serial.print((float)binaryBytes / messages);
+    Serial.print(F("/"));
+    Serial.println((float)binaryBytes / (messages * MAX_BATCH_SIZE));
+    Serial.print(F("  Compression ratio: "));
+    Serial.println((float)textBytes / binaryBytes);
+    Serial.print(F("  Encode/decode per message [us]: "));
+    Serial.print(encodeTime / messages);
+    Serial.print(F("/"));
+    Serial.println(decodeTime / messages);
+    Serial.print(F("  Round trip errors: "));
+    Serial.println(errors);
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial) {}
+
+    runSeries("Temperature, 1 Hz", temperature, 1000);
+    runSeries("Vibration, 100 Hz", vibration, 10);
+    Serial.println();
+    Serial.println(F("Encoding done"));
+}
+
+void loop()
+{
+}
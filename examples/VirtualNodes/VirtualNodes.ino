@@ -0,0 +1,143 @@
+/**
+ * VirtualNodes.ino
+ *
+ * Runs several nodes in one sketch over a single MQTT connection, for example to let one
+ * board act as a gateway for sensors on a bus. All nodes use RLDefaultSession, which routes
+ * the messages on node topics to the node with the MAC in the topic.
+ *
+ * The connection is an RLDataAccessSimulator that answers the dataaccess requests like
+ * the backend, so the sketch runs without a network. It reports the memory used per node.
+ *
+ * Owned by: RealTest AB
+ */
+
+// Every node subscribes to its own topics and the startup requests of all nodes are answered
+// at the same time, room for all of them on the loopback broker
+#define LOOPBACK_MAX_SUBSCRIPTIONS 48
+#define LOOPBACK_BUFFER_SIZE 4096
+#define SIMULATOR_MAX_PENDING 32
+
+#include <RLNode.h>
+#include <RLDataAccessSimulator.h>
+#include <RLMemory.h>
+
+#define VIRTUAL_NODE_COUNT 8
+#define VIRTUAL_RUN_TIME 10000  // Duration of the run in ms
+
+// One channel per node and smaller buffers than the default RLNode,
+// the topic pool holds the fixed node topics and the short publish topic of the channel
+typedef RLNodeSized<1, 384, 64, 256> VirtualNode;
+
+RLDataAccessSimulator client;
+VirtualNode* nodes[VIRTUAL_NODE_COUNT];
+RLChannel* channels[VIRTUAL_NODE_COUNT];
+char macs[VIRTUAL_NODE_COUNT][13];
+unsigned long nodeMessages[VIRTUAL_NODE_COUNT];
+
+int32_t readSensor(bool* forcePublish)
+{
+    return micros() % 1000;
+}
+
+// Counts the samples of each node, published on virtual/<node index>
+void onPublish(const char* topic, const uint8_t* payload, unsigned int length)
+{
+    if (strncmp(topic, "virtual/", 8))
+        return;
+    int node = atoi(topic + 8);
+    if (node >= 0 && node < VIRTUAL_NODE_COUNT)
+        nodeMessages[node]++;
+}
+
+// Channel configurations handed out by the simulated dataaccess, the publish topic holds the index of the node
+void onConfiguration(JsonObject configuration, const char* mac, int channelId)
+{
+    int node = 0;
+    for (int i = 0; i < VIRTUAL_NODE_COUNT; i++)
+    {
+        if (!strcmp(mac, macs[i]))
+            node = i;
+    }
+    char publishTopic[16] = "virtual/";
+    intTochar(node, publishTopic + 8);
+    configuration["PublishTopic"] = publishTopic;
+    configuration["SampleRate"] = 10;
+}
+
+void loopNodes()
+{
+    for (int i = 0; i < VIRTUAL_NODE_COUNT; i++)
+    {
+        nodes[i]->loop();
+    }
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial) {}
+
+    client.setPublishHandler(onPublish);
+    client.setConfigurationHandler(onConfiguration);
+    long memoryBefore = freeMemory();
+    for (int i = 0; i < VIRTUAL_NODE_COUNT; i++)
+    {
+        strcpy(macs[i], "5E55100000");
+        macs[i][10] = '0' + i / 10;
+        macs[i][11] = '0' + i % 10;
+        macs[i][12] = '\0';
+        nodes[i] = new VirtualNode();
+        channels[i] = new RLChannel("Virtual", 1000, readSensor);
+        nodes[i]->addChannel(channels[i]);
+        nodes[i]->setPipelinedRequests(true);
+        nodes[i]->begin(client, macs[i], "loopback", 1883);
+    }
+    long memoryAfter = freeMemory();
+
+    Serial.println();
+    Serial.print(F("Nodes sharing the session: "));
+    Serial.println(RLDefaultSession.nodeCount());
+    Serial.print(F("  Size of a node [bytes]: "));
+    Serial.println(sizeof(VirtualNode));
+    Serial.print(F("  Size of a channel [bytes]: "));
+    Serial.println(sizeof(RLChannel));
+    if (memoryBefore >= 0)
+    {
+        Serial.print(F("  Memory used per node [bytes]: "));
+        Serial.println((memoryBefore - memoryAfter) / VIRTUAL_NODE_COUNT);
+    }
+
+    // Run until the configuration requests of all nodes are answered
+    bool pending = true;
+    while (pending)
+    {
+        loopNodes();
+        pending = false;
+        for (int i = 0; i < VIRTUAL_NODE_COUNT; i++)
+            pending = pending || nodes[i]->requestsPending();
+    }
+
+    memset(nodeMessages, 0, sizeof(nodeMessages));
+    unsigned long start = millis();
+    while (millis() - start < VIRTUAL_RUN_TIME)
+    {
+        loopNodes();
+    }
+    for (int i = 0; i < VIRTUAL_NODE_COUNT; i++)
+    {
+        Serial.print(F("  Node "));
+        Serial.print(macs[i]);
+        Serial.print(F(": "));
+        Serial.print(nodeMessages[i] * 1000.0 / VIRTUAL_RUN_TIME);
+        Serial.println(F(" publishes/s"));
+    }
+    // Every node has configured its channel, so this is all the pool ever holds
+    Serial.print(F("  Topic pool used per node [bytes]: "));
+    Serial.println(nodes[0]->getTopicPool().footprint());
+    Serial.println();
+    Serial.println(F("VirtualNodes done"));
+}
+
+void loop()
+{
+}
@@ -0,0 +1,103 @@
+/**
+ * AcquisitionStress.cpp
+ *
+ * Stress test of the acquisition ring buffer (RLSpscRing) on the host. A thread stands in for the
+ * timer interrupt and pushes numbered samples as fast as it can, the main thread stands in for loop()
+ * and pops them for STRESS_TIME ms. Every sample must arrive once and in order, or be counted in Dropped.
+ *
+ * Runs one pass where the consumer keeps up and one where it is slow so the ring is often full.
+ * Returns 0 if no sample was lost, duplicated, reordered or torn.
+ * Build with -fsanitize=thread to also check the memory ordering.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "Arduino.h"
+#include "RLSpscRing.h"
+#include <atomic>
+#include <thread>
+
+#define STRESS_TIME 2000  // Duration in ms of each pass
+#define STRESS_RING_SIZE 16  // Same as the default ACQUISITION_BUFFER_SIZE of RLNode
+#define STRESS_PRODUCER_SPIN 64  // Max busy loop iterations between two pushes, the timer period of the interrupt
+
+// Same layout as RLAcquiredSample, Time and Value are derived from the sequence number so a torn read shows
+struct StressSample
+{
+    unsigned long Time;
+    int32_t Value;
+    bool Force;
+};
+
+static bool runPass(const char* name, unsigned int consumerDelay)
+{
+    RLSpscRing<StressSample, STRESS_RING_SIZE> ring;
+    std::atomic<bool> done(false);
+    unsigned long pushed = 0;
+
+    std::thread producer([&]() {
+        unsigned long start = millis();
+        for (unsigned long i = 1; millis() - start < STRESS_TIME; i++)
+        {
+            StressSample sample;
+            sample.Time = i;
+            sample.Value = (int32_t)(i * 3);
+            sample.Force = (i & 1) != 0;
+            ring.push(sample);
+            pushed++;
+            // A varying period, so pushes and pops meet at every position of the ring,
+            // and a yield now and then so the consumer also runs on a host with one core
+            for (volatile unsigned long spin = i * 7919 % STRESS_PRODUCER_SPIN; spin > 0; spin--) {}
+            if (i % (STRESS_RING_SIZE / 2) == 0)
+                yield();
+        }
+        done.store(true, std::memory_order_release);
+    });
+
+    unsigned long received = 0;
+    unsigned long last = 0;
+    unsigned long errors = 0;
+    StressSample sample;
+    while (true)
+    {
+        // Read done before popping, so the ring is known to be drained once done is seen
+        bool finished = done.load(std::memory_order_acquire);
+        bool popped = false;
+        while (ring.pop(sample))
+        {
+            popped = true;
+            received++;
+            if (sample.Time <= last || sample.Value != (int32_t)(sample.Time * 3) ||
+                sample.Force != ((sample.Time & 1) != 0))
+                errors++;
+            last = sample.Time;
+            if (consumerDelay > 0 && received % 64 == 0)
+                delayMicroseconds(consumerDelay);
+        }
+        if (finished && !popped)
+            break;
+    }
+    producer.join();
+
+    unsigned long dropped = ring.Dropped;
+    bool passed = errors == 0 && received > 0 && received + dropped == pushed;
+    Serial.print(name);
+    Serial.print(F(": pushed/received/dropped/errors "));
+    Serial.print(pushed);
+    Serial.print(F("/"));
+    Serial.print(received);
+    Serial.print(F("/"));
+    Serial.print(dropped);
+    Serial.print(F("/"));
+    Serial.print(errors);
+    Serial.println(passed ? F(" [Passed]") : F(" [Failed]"));
+    return passed;
+}
+
+int main()
+{
+    bool passed = runPass("Fast consumer", 0);
+    passed = runPass("Slow consumer", 50) && passed;
+    Serial.flush();
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+/**
+ * Arduino.cpp
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "Arduino.h"
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial;
+
+// Start of the process, millis() and micros() count from here like they count from reset on a board
+static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long micros()
+{
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void yield()
+{
+    std::this_thread::yield();
+}
+
+long random(long max)
+{
+    return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+    return max > min ? min + random(max - min) : min;
+}
+
+void randomSeed(unsigned long seed)
+{
+    srand((unsigned int)seed);
+}
+
+// ******************************************************************
+// Print
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+    size_t written = 0;
+    while (size-- > 0 && write(*buffer++) == 1)
+        written++;
+    return written;
+}
+
+size_t Print::print(unsigned long long value, int base)
+{
+    char digits[65];
+    char* text = digits + sizeof(digits) - 1;
+    *text = '\0';
+    if (base < 2)
+        base = DEC;
+    do
+    {
+        int digit = (int)(value % base);
+        *--text = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value > 0);
+    return write(text);
+}
+
+size_t Print::print(long long value, int base)
+{
+    // Negative numbers are only signed in base 10, like the Arduino core
+    if (value < 0 && base == DEC)
+        return print('-') + print((unsigned long long)(-(value + 1)) + 1, base);
+    return print((unsigned long long)value, base);
+}
+
+size_t Print::print(double value, int digits)
+{
+    if (isnan(value))
+        return write("nan");
+    if (isinf(value))
+        return write("inf");
+    char text[64];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return write(text);
+}
+
+// ******************************************************************
+// Serial
+size_t HardwareSerial::write(uint8_t c)
+{
+    return fputc(c, stdout) != EOF ? 1 : 0;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+void HardwareSerial::flush()
+{
+    fflush(stdout);
+}
@@ -0,0 +1,72 @@
+/**
+ * Arduino.h
+ *
+ * The part of the Arduino core used by RLNode, PubSubClient and the examples, for the host build.
+ * Time is the monotonic clock of the host since the start of the process, Serial writes to stdout.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+
+#define RLNODE_HOST 1
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#ifndef DEC
+#define DEC 10
+#define HEX 16
+#endif
+
+// Strings stay in RAM, F() only changes the type so the flash overloads are used
+class __FlashStringHelper;
+#define F(string) (reinterpret_cast<const __FlashStringHelper*>(string))
+#define PROGMEM
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+// There are no interrupts on the host, code that runs in an interrupt on a board runs in a thread
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long) {}
+    void end() {}
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    int availableForWrite() { return 4096; }
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush();
+    operator bool() { return true; }
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * IPAddress.h
+ *
+ * IPv4 address of the Arduino core for the host build.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress
+{
+public:
+    IPAddress() { memset(Bytes, 0, sizeof(Bytes)); }
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+    {
+        Bytes[0] = first;
+        Bytes[1] = second;
+        Bytes[2] = third;
+        Bytes[3] = fourth;
+    }
+    IPAddress(const uint8_t* address) { memcpy(Bytes, address, sizeof(Bytes)); }
+    uint8_t operator[](int index) const { return Bytes[index]; }
+    uint8_t& operator[](int index) { return Bytes[index]; }
+    bool operator==(const IPAddress& other) const { return !memcmp(Bytes, other.Bytes, sizeof(Bytes)); }
+private:
+    uint8_t Bytes[4];
+};
+
+#endif
@@ -0,0 +1,87 @@
+/**
+ * Memory.cpp
+ *
+ * Counts the heap allocations of the host programs, reported by allocatedMemory() in RLMemory.h.
+ * operator new is replaced here, malloc, calloc and realloc are counted when the program is linked
+ * with --wrap for them (HOST_WRAP_MALLOC), as the CMake build does on Linux.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+static std::atomic<unsigned long> allocatedBytes(0);
+
+long hostAllocatedBytes()
+{
+    return (long)allocatedBytes.load(std::memory_order_relaxed);
+}
+
+static void count(size_t size)
+{
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+#ifdef HOST_WRAP_MALLOC
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __real_calloc(size_t count, size_t size);
+extern "C" void* __real_realloc(void* pointer, size_t size);
+#define uncountedMalloc __real_malloc
+
+extern "C" void* __wrap_malloc(size_t size)
+{
+    count(size);
+    return __real_malloc(size);
+}
+
+extern "C" void* __wrap_calloc(size_t number, size_t size)
+{
+    count(number * size);
+    return __real_calloc(number, size);
+}
+
+// A realloc counts its new size, like a malloc followed by a free
+extern "C" void* __wrap_realloc(void* pointer, size_t size)
+{
+    count(size);
+    return __real_realloc(pointer, size);
+}
+#else
+#define uncountedMalloc malloc
+#endif
+
+void* operator new(size_t size)
+{
+    count(size);
+    void* pointer = uncountedMalloc(size > 0 ? size : 1);
+    if (pointer == NULL)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+    free(pointer);
+}
@@ -0,0 +1,22 @@
+/**
+ * Stream.h
+ *
+ * Stream of the Arduino core for the host build, without the parsing and timeout helpers.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * main.cpp
+ *
+ * Runs a sketch on the host: setup() once, then loop() until HOST_LOOP_TIME ms have passed.
+ * The examples do their work in setup(), so by default loop() is not called.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "Arduino.h"
+
+#ifndef HOST_LOOP_TIME
+#define HOST_LOOP_TIME 0
+#endif
+
+void setup();
+void loop();
+
+int main()
+{
+    setup();
+#if HOST_LOOP_TIME > 0
+    unsigned long start = millis();
+    while (millis() - start < HOST_LOOP_TIME)
+    {
+        loop();
+    }
+#endif
+    Serial.flush();
+    return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * RLBinaryCodec.cpp
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "RLBinaryCodec.h"
+
+// Significant digits that fit in a 64 bit scaled value
+#define BINARY_CODEC_MAX_DIGITS 18
+
+// ******************************************************************
+// Encoder
+int RLBinaryEncoder::decimals(const char* text)
+{
+    if (*text == '-')
+        text++;
+    int digits = 0;
+    int decimals = -1;
+    for (; *text != '\0'; text++)
+    {
+        if (*text == '.' && decimals < 0)
+            decimals = 0;
+        else if (*text >= '0' && *text <= '9')
+        {
+            digits++;
+            if (decimals >= 0)
+                decimals++;
+        }
+        else
+            return -1;
+    }
+    if (digits == 0 || digits > BINARY_CODEC_MAX_DIGITS || decimals > BINARY_CODEC_MAX_DECIMALS)
+        return -1;
+    return decimals < 0 ? 0 : decimals;
+}
+
+void RLBinaryEncoder::begin(uint8_t decimals, unsigned long age)
+{
+    Length = 0;
+    Overflow = false;
+    First = true;
+    Decimals = decimals;
+    putByte(BINARY_CODEC_MARKER | BINARY_CODEC_VERSION);
+    putByte(decimals);
+    putVarint(age);
+}
+
+void RLBinaryEncoder::begin(uint8_t decimals, unsigned long age, unsigned long seconds, unsigned int milliseconds)
+{
+    Length = 0;
+    Overflow = false;
+    First = true;
+    Decimals = decimals;
+    putByte(BINARY_CODEC_MARKER | BINARY_CODEC_VERSION);
+    putByte((BINARY_CODEC_FLAG_TIME << 4) | decimals);
+    putVarint(age);
+    putVarint(seconds);
+    putVarint(milliseconds);
+}
+
+bool RLBinaryEncoder::add(unsigned long time, const char* value)
+{
+    // Parse the decimal string into an integer scaled by 10^Decimals, without going through a float
+    int decimals = RLBinaryEncoder::decimals(value);
+    if (decimals < 0 || decimals > Decimals)
+    {
+        Overflow = true;
+        return false;
+    }
+    bool negative = *value == '-';
+    int64_t scaled = 0;
+    int digits = Decimals - decimals;  // Zeros added by the scaling
+    for (const char* c = negative ? value + 1 : value; *c != '\0'; c++)
+    {
+        if (*c != '.')
+        {
+            scaled = scaled * 10 + (*c - '0');
+            if (scaled > 0)
+                digits++;
+        }
+    }
+    // The scaled value must fit in 64 bits, not only the digits of the text
+    if (digits > BINARY_CODEC_MAX_DIGITS)
+    {
+        Overflow = true;
+        return false;
+    }
+    for (int i = decimals; i < Decimals; i++)
+        scaled *= 10;
+    if (negative)
+        scaled = -scaled;
+
+    unsigned long delta = First ? 0 : time - PreviousTime;
+    int64_t difference = scaled - PreviousValue;
+    size_t length = Length;
+    putVarint(delta);
+    putVarint(((uint64_t)difference << 1) ^ (uint64_t)(difference >> 63));
+    if (Overflow)
+    {
+        Length = length;
+        return false;
+    }
+    First = false;
+    PreviousTime = time;
+    PreviousValue = scaled;
+    return true;
+}
+
+void RLBinaryEncoder::putByte(uint8_t b)
+{
+    if (Length < Size)
+        Buffer[Length++] = b;
+    else
+        Overflow = true;
+}
+
+void RLBinaryEncoder::putVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        putByte((uint8_t)value | 0x80);
+        value >>= 7;
+    }
+    putByte((uint8_t)value);
+}
+
+// ******************************************************************
+// Decoder
+bool RLBinaryDecoder::begin()
+{
+    Position = 0;
+    Offset = 0;
+    Value = 0;
+    Error = false;
+    if (Size < 3 || (Payload[0] & 0xF0) != BINARY_CODEC_MARKER)
+        return false;
+    Version = Payload[0] & 0x0F;
+    if (Version != BINARY_CODEC_VERSION)
+        return false;
+    Decimals = Payload[1] & 0x0F;
+    HasTime = (Payload[1] >> 4) & BINARY_CODEC_FLAG_TIME;
+    Position = 2;
+    uint64_t age, seconds = 0, milliseconds = 0;
+    if (Decimals > BINARY_CODEC_MAX_DECIMALS || !getVarint(age) ||
+        (HasTime && (!getVarint(seconds) || !getVarint(milliseconds))))
+        return false;
+    Age = age;
+    Seconds = seconds;
+    Milliseconds = milliseconds;
+    return true;
+}
+
+bool RLBinaryDecoder::next(unsigned long& offset, int64_t& value)
+{
+    if (Position >= Size)
+        return false;
+    uint64_t delta, difference;
+    if (!getVarint(delta) || !getVarint(difference))
+    {
+        Error = true;
+        return false;
+    }
+    Offset += delta;
+    Value += (int64_t)(difference >> 1) ^ -(int64_t)(difference & 1);
+    offset = Offset;
+    value = Value;
+    return true;
+}
+
+void RLBinaryDecoder::format(int64_t value, uint8_t decimals, char* output)
+{
+    char digits[24];
+    int count = 0;
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do
+    {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0 || count <= decimals);
+    if (value < 0)
+        *output++ = '-';
+    while (count > 0)
+    {
+        if (count == decimals)
+            *output++ = '.';
+        *output++ = digits[--count];
+    }
+    *output = '\0';
+}
+
+bool RLBinaryDecoder::getVarint(uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && Position < Size; shift += 7)
+    {
+        uint8_t b = Payload[Position++];
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,87 @@
+/**
+ * RLBinaryCodec.h
+ *
+ * Compact binary encoding of sample messages, selected per channel with "Encoding": "Binary".
+ * The samples are decimal strings, they are sent as integers scaled by 10^Decimals so the
+ * numeric values are restored exactly. The text is not: every value of a message is decoded with
+ * the Decimals of the message ("12.5" in a message with 2 decimals gives "12.50") and "-0" gives "0".
+ * A message is only encoded if every scaled value has at most 18 digits.
+ *
+ * Format (version 1), varints are unsigned LEB128 and signed values are zigzag encoded:
+ *   byte     0xB0 | version, not valid UTF-8 so a binary message can not be taken for text
+ *   byte     flags << 4 | Decimals, flag 1 is set if the epoch time of the first sample follows
+ *   varint   Age, ms since the first sample was read
+ *   varint   Seconds and varint Milliseconds, epoch time of the first sample (if flag 1 is set)
+ *   Then for each sample, until the end of the message:
+ *   varint   ms since the previous sample (0 for the first sample)
+ *   zigzag   scaled value minus the scaled value of the previous sample (0 before the first sample)
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLBinaryCodec_h
+#define RLBinaryCodec_h
+
+#include "Arduino.h"
+
+#define BINARY_CODEC_VERSION 1
+#define BINARY_CODEC_MARKER 0xB0
+#define BINARY_CODEC_FLAG_TIME 0x01
+#define BINARY_CODEC_MAX_DECIMALS 9
+#define BINARY_CODEC_HEADER_SIZE 14  // Max size of the header
+#define BINARY_CODEC_SAMPLE_SIZE 15  // Max size of a sample, 32 bit time and 64 bit value
+
+class RLBinaryEncoder
+{
+public:
+    RLBinaryEncoder(uint8_t* buffer, size_t size) : Buffer(buffer), Size(size) {}
+    // Decimals of a decimal number ("-12.50" has 2), -1 if text is not a number that can be encoded
+    static int decimals(const char* text);
+    // Start a message, decimals is the highest decimals() of the samples in the message
+    void begin(uint8_t decimals, unsigned long age);
+    void begin(uint8_t decimals, unsigned long age, unsigned long seconds, unsigned int milliseconds);
+    // Add a sample read at time (ms), returns false if it does not fit or value can not be encoded,
+    // also when value scaled by 10^Decimals has more than 18 digits
+    bool add(unsigned long time, const char* value);
+    size_t length() { return Overflow ? 0 : Length; }  // Size of the message, 0 if anything did not fit
+protected:
+    void putByte(uint8_t b);
+    void putVarint(uint64_t value);
+    uint8_t* Buffer;
+    size_t Size;
+    size_t Length = 0;
+    bool Overflow = false;
+    uint8_t Decimals = 0;
+    unsigned long PreviousTime = 0;
+    int64_t PreviousValue = 0;
+    bool First = true;
+};
+
+// Reference decoder, used by the backend implementation and the Encoding example
+class RLBinaryDecoder
+{
+public:
+    RLBinaryDecoder(const uint8_t* payload, size_t length) : Payload(payload), Size(length) {}
+    // Read the header, false if the message is not a binary sample message of a known version
+    bool begin();
+    // Read the next sample, offset is the time in ms after the first sample and value is scaled by 10^Decimals
+    bool next(unsigned long& offset, int64_t& value);
+    // Format a scaled value as a decimal string with decimals decimals
+    static void format(int64_t value, uint8_t decimals, char* output);
+    uint8_t Version = 0;
+    uint8_t Decimals = 0;
+    unsigned long Age = 0;
+    bool HasTime = false;
+    unsigned long Seconds = 0;
+    unsigned int Milliseconds = 0;
+    bool Error = false;  // Set if the message ended inside a sample
+protected:
+    bool getVarint(uint64_t& value);
+    const uint8_t* Payload;
+    size_t Size;
+    size_t Position = 0;
+    unsigned long Offset = 0;
+    int64_t Value = 0;
+};
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * RLDataAccessSimulator.h
+ *
+ * Local stand-in for the MQTT broker and the dataaccess service, so the startup and
+ * configuration protocol of RLNode can be tested without the backend.
+ *
+ * Requests on req/rtl/dataaccess/<request> are answered on their ResponseTopic after Latency
+ * plus a random part of Jitter ms. Responses can be lost, held back so later responses overtake
+ * them, or preceded by a "Processing" interim response. Channel configurations publish on
+ * sim/<NodeId>/<ChannelId>/<Generation>, Generation is increased by every reconfiguration
+ * so the first sample with a new configuration can be told from the earlier samples.
+ *
+ * The backend side of the other commands is simulated by identificationPoll(), setChannelConfiguration()
+ * and configurationChanged(), which time the replies of the node.
+ *
+ * The examples use it as the dataaccess responder, and change the channel configurations it hands out
+ * with setConfigurationHandler().
+ *
+ * The answers are delivered from available(), which PubSubClient calls from loop().
+ * Each queued answer takes SIMULATOR_MESSAGE_SIZE bytes, meant for hosts and boards with plenty of RAM.
+ * Messages are built in documents of SIMULATOR_JSON_SIZE bytes, a message that does not fit is not sent
+ * and counted in Overflows, so a truncated answer never looks like a node error.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLDataAccessSimulator_h
+#define RLDataAccessSimulator_h
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "RLLoopbackClient.h"
+
+// Can be defined before including this file
+#ifndef SIMULATOR_MAX_PENDING
+#define SIMULATOR_MAX_PENDING 16  // Answers waiting to be delivered
+#endif
+#ifndef SIMULATOR_MESSAGE_SIZE
+#define SIMULATOR_MESSAGE_SIZE 256  // Serialized message
+#endif
+#ifndef SIMULATOR_JSON_SIZE
+#define SIMULATOR_JSON_SIZE 512  // JSON documents, the slots take twice the room on 64 bit hosts
+#endif
+#define SIMULATOR_EPOCH 1700000000UL  // Epoch time in seconds of millis() 0, used to answer time sync requests
+#define SIMULATOR_RESPONSE_TOPIC "res/rtl/dataaccess/"  // Replies to the commands of the simulated backend
+
+// Called for every channel configuration after PublishTopic and SampleRate are set, can change or add fields
+#define SIMULATOR_CONFIGURATION_HANDLER void (*configurationHandler)(JsonObject configuration, const char* mac, int channelId)
+
+class RLDataAccessSimulator : public RLLoopbackClient
+{
+public:
+    // Behaviour, can be changed at any time
+    unsigned long Latency = 0;  // Min time in ms before a request is answered
+    unsigned long Jitter = 0;  // Max random time in ms added to Latency
+    uint8_t LossPercent = 0;  // Requests that are never answered
+    uint8_t ReorderPercent = 0;  // Answers held back Latency + Jitter ms more, so later answers arrive first
+    uint8_t ProcessingPercent = 0;  // Requests answered with "Processing" first
+    unsigned long ProcessingDelay = 0;  // Time in ms between the "Processing" and the final answer
+    float SampleRate = 1.0f;  // Sample rate of the channel configurations
+    unsigned int Generation = 0;  // Increased by setChannelConfiguration() and configurationChanged()
+
+    // Counters, reset with resetSimulator()
+    unsigned long Requests = 0;  // Requests to dataaccess
+    unsigned long Answers = 0;  // Answers delivered, including "Processing" answers
+    unsigned long Lost = 0;
+    unsigned long Reordered = 0;
+    unsigned long Processing = 0;
+    unsigned long Overflows = 0;  // Answers and commands not sent since the queue, a document or the client buffer was full
+    // Replies of the node to the simulated backend commands
+    unsigned long CommandTime = 0;  // Time (millis) of the latest command
+    unsigned long CommandReplies = 0;
+    unsigned long CommandLatency = 0;  // Time in ms from the latest command to its reply
+    char CommandStatus[16] = "";  // CmdStatus of the latest reply
+
+    void setConfigurationHandler(SIMULATOR_CONFIGURATION_HANDLER) { this->configurationHandler = configurationHandler; }
+
+    void resetSimulator()
+    {
+        Requests = 0;
+        Answers = 0;
+        Lost = 0;
+        Reordered = 0;
+        Processing = 0;
+        Overflows = 0;
+        CommandReplies = 0;
+        CommandLatency = 0;
+        CommandStatus[0] = '\0';
+        for (int i = 0; i < SIMULATOR_MAX_PENDING; i++)
+            Pending[i].Used = false;
+    }
+
+    // Answers waiting to be delivered
+    int pending()
+    {
+        int count = 0;
+        for (int i = 0; i < SIMULATOR_MAX_PENDING; i++)
+            count += Pending[i].Used;
+        return count;
+    }
+
+    // Send an identification poll to all nodes
+    bool identificationPoll()
+    {
+        return command("req/rtl/logger/identificationpoll", "identificationpoll", NULL);
+    }
+
+    // Push a new configuration to one channel of a node, as the backend does when a channel is changed
+    bool setChannelConfiguration(const char* mac, int channelId, float sampleRate)
+    {
+        char topic[LOOPBACK_MAX_TOPIC_LENGTH];
+        lowerTopic(topic, "req/rtl/", mac, "/setchannelconfiguration");
+        StaticJsonDocument<SIMULATOR_JSON_SIZE> message;
+        Generation++;
+        JsonObject payload = message.createNestedObject("Payload");
+        payload["ChannelId"] = channelId;
+        buildConfiguration(payload.createNestedObject("Configuration"), mac, channelId, sampleRate);
+        return command(topic, "setchannelconfiguration", &message);
+    }
+
+    // Notify a node that its configuration has changed, the node fetches all channel configurations
+    bool configurationChanged(const char* mac)
+    {
+        char topic[LOOPBACK_MAX_TOPIC_LENGTH];
+        strcpy(topic, "not/");
+        strcat(topic, mac);
+        strcat(topic, "/configuration");
+        Generation++;
+        CommandTime = millis();
+        return inject(topic, "{}");
+    }
+
+    // Client, delivers the answers that are due before the node reads
+    int available()
+    {
+        deliver();
+        return RLLoopbackClient::available();
+    }
+
+protected:
+    struct Answer
+    {
+        bool Used = false;
+        unsigned long Due = 0;
+        char Topic[LOOPBACK_MAX_TOPIC_LENGTH];
+        char Payload[SIMULATOR_MESSAGE_SIZE];
+    };
+    Answer Pending[SIMULATOR_MAX_PENDING];
+    SIMULATOR_CONFIGURATION_HANDLER = NULL;
+
+    void onPublish(const char* topic, const uint8_t* payload, unsigned int length)
+    {
+        if (!strncmp(topic, "req/rtl/dataaccess/", 19))
+            answer(topic + 19, payload, length);
+        else if (!strncmp(topic, SIMULATOR_RESPONSE_TOPIC, strlen(SIMULATOR_RESPONSE_TOPIC)))
+            reply(payload, length);
+        else
+            RLLoopbackClient::onPublish(topic, payload, length);
+    }
+
+    // Queue the answer to a request to dataaccess
+    void answer(const char* request, const uint8_t* payload, unsigned int length)
+    {
+        StaticJsonDocument<SIMULATOR_JSON_SIZE> message;
+        StaticJsonDocument<SIMULATOR_JSON_SIZE> response;
+        Requests++;
+        DeserializationError error = deserializeJson(message, (const char*)payload, length);
+        if (error == DeserializationError::NoMemory)
+            Overflows++;
+        if (error || !message["ResponseTopic"].is<const char*>())
+            return;
+        if ((uint8_t)random(100) < LossPercent)
+        {
+            Lost++;
+            return;
+        }
+
+        const char* responseTopic = message["ResponseTopic"];
+        unsigned long delayTime = Latency + (Jitter > 0 ? random(Jitter + 1) : 0);
+        if ((uint8_t)random(100) < ReorderPercent)
+        {
+            delayTime += Latency + Jitter;
+            Reordered++;
+        }
+        response["CorrelationData"] = message["CorrelationData"];
+        if ((uint8_t)random(100) < ProcessingPercent)
+        {
+            response["CmdStatus"] = "Processing";
+            queue(responseTopic, response, delayTime);
+            delayTime += ProcessingDelay;
+            Processing++;
+        }
+
+        response["CmdStatus"] = "Done";
+        if (!strcmp(request, "getchannelconfiguration"))
+        {
+            int channelId = message["Payload"]["ChannelId"];
+            response["Payload"]["ChannelId"] = channelId;
+            buildConfiguration(response["Payload"].createNestedObject("Configuration"),
+                               message["Payload"]["NodeId"] | "", channelId, SampleRate);
+        }
+        else if (!strcmp(request, "timesync"))
+        {
+            // Time when the request is handled, halfway through the simulated round trip
+            unsigned long now = millis() + delayTime / 2;
+            response["Payload"]["Seconds"] = SIMULATOR_EPOCH + now / 1000;
+            response["Payload"]["Milliseconds"] = now % 1000;
+        }
+        queue(responseTopic, response, delayTime);
+    }
+
+    // Reply from the node to one of the commands of the simulated backend
+    void reply(const uint8_t* payload, unsigned int length)
+    {
+        StaticJsonDocument<SIMULATOR_JSON_SIZE> message;
+        if (deserializeJson(message, (const char*)payload, length))
+            return;
+        CommandReplies++;
+        CommandLatency = millis() - CommandTime;
+        strncpy(CommandStatus, message["CmdStatus"] | "", sizeof(CommandStatus) - 1);
+        CommandStatus[sizeof(CommandStatus) - 1] = '\0';
+    }
+
+    bool command(const char* topic, const char* name, JsonDocument* message)
+    {
+        StaticJsonDocument<SIMULATOR_JSON_SIZE> empty;
+        JsonDocument& command = message != NULL ? *message : empty;
+        char responseTopic[LOOPBACK_MAX_TOPIC_LENGTH];
+        char payload[SIMULATOR_MESSAGE_SIZE];
+        strcpy(responseTopic, SIMULATOR_RESPONSE_TOPIC);
+        strcat(responseTopic, name);
+        command["ResponseTopic"] = responseTopic;
+        command["CorrelationData"] = "simulator";
+        if (command.overflowed() || measureJson(command) >= sizeof(payload))
+        {
+            Overflows++;
+            return false;
+        }
+        serializeJson(command, payload, sizeof(payload));
+        CommandTime = millis();
+        return inject(topic, payload);
+    }
+
+    void buildConfiguration(JsonObject configuration, const char* mac, int channelId, float sampleRate)
+    {
+        char topic[LOOPBACK_MAX_TOPIC_LENGTH];
+        char number[24];
+        strcpy(topic, "sim/");
+        strcat(topic, mac);
+        sprintf(number, "/%d/%u", channelId, Generation);
+        strcat(topic, number);
+        configuration["PublishTopic"] = topic;
+        configuration["SampleRate"] = sampleRate;
+        if (configurationHandler != NULL)
+            configurationHandler(configuration, mac, channelId);
+    }
+
+    void queue(const char* topic, JsonDocument& message, unsigned long delayTime)
+    {
+        if (message.overflowed() || measureJson(message) >= SIMULATOR_MESSAGE_SIZE)
+        {
+            Overflows++;
+            return;
+        }
+        for (int i = 0; i < SIMULATOR_MAX_PENDING; i++)
+        {
+            if (Pending[i].Used)
+                continue;
+            Pending[i].Used = true;
+            Pending[i].Due = millis() + delayTime;
+            strncpy(Pending[i].Topic, topic, LOOPBACK_MAX_TOPIC_LENGTH - 1);
+            Pending[i].Topic[LOOPBACK_MAX_TOPIC_LENGTH - 1] = '\0';
+            serializeJson(message, Pending[i].Payload, SIMULATOR_MESSAGE_SIZE);
+            return;
+        }
+        Overflows++;
+    }
+
+    // Deliver the answers that are due, earliest first
+    void deliver()
+    {
+        while (true)
+        {
+            Answer* next = NULL;
+            for (int i = 0; i < SIMULATOR_MAX_PENDING; i++)
+            {
+                Answer& answer = Pending[i];
+                if (answer.Used && (long)(millis() - answer.Due) >= 0 &&
+                    (next == NULL || (long)(answer.Due - next->Due) < 0))
+                    next = &answer;
+            }
+            if (next == NULL)
+                return;
+            // Answers on topics the node no longer listens to are lost, like on a real broker
+            // Answers that do not fit in the client buffer wait until the node has read it,
+            // unless they do not fit in an empty buffer either
+            bool subscribed = isSubscribed(next->Topic);
+            if (subscribed && !inject(next->Topic, next->Payload))
+            {
+                if (TxCount > 0)
+                    return;
+                Overflows++;
+            }
+            else if (subscribed)
+                Answers++;
+            next->Used = false;
+        }
+    }
+
+    // Node topics use the MAC in lower case
+    static void lowerTopic(char* topic, const char* first, const char* mac, const char* last)
+    {
+        strcpy(topic, first);
+        char* end = topic + strlen(topic);
+        while (*mac != '\0')
+            *end++ = tolower(*mac++);
+        strcpy(end, last);
+    }
+};
+
+#endif
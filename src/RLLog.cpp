@@ -0,0 +1,51 @@
+/**
+ * RLLog.cpp
+ *
+ * Logging for RLNode, see RLLog.h
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "RLLog.h"
+
+RLLogger RLLog;
+
+#if RL_LOG_BUFFER_SIZE > 0
+
+// Deferred: add the character to the ring buffer
+size_t RLLogger::write(uint8_t c)
+{
+    if (Count == RL_LOG_BUFFER_SIZE)
+    {
+        Dropped++;
+        return 0;
+    }
+    Buffer[(Head + Count) % RL_LOG_BUFFER_SIZE] = c;
+    Count++;
+    return 1;
+}
+
+void RLLogger::drain()
+{
+    int room = Serial.availableForWrite();
+    while (Count > 0 && room-- > 0)
+    {
+        Serial.write(Buffer[Head]);
+        Head = (Head + 1) % RL_LOG_BUFFER_SIZE;
+        Count--;
+    }
+}
+
+#else
+
+// Direct: write the character to Serial
+size_t RLLogger::write(uint8_t c)
+{
+    return Serial.write(c);
+}
+
+void RLLogger::drain()
+{
+}
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * RLLog.h
+ *
+ * Logging for RLNode with compile-time log levels.
+ * Log calls above RL_LOG_LEVEL compile to nothing, their arguments are not evaluated.
+ * Set RL_LOG_LEVEL (and RL_LOG_BUFFER_SIZE) with build flags, e.g. -DRL_LOG_LEVEL=RL_LOG_LEVEL_DEBUG,
+ * since defines in the sketch do not reach the library.
+ *
+ * With RL_LOG_BUFFER_SIZE > 0 the log is deferred: lines are written to a RAM ring buffer
+ * and RLNode::loop() moves them to Serial when no channel is due, without blocking on a full
+ * serial buffer. Characters that do not fit in the ring buffer are dropped and counted.
+ *
+ * Usage: RL_LOG_INFO(F("  Channel "), ID, F(" started"));  // Arguments are printed in order, followed by a newline
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLLog_h
+#define RLLog_h
+
+#include "Arduino.h"
+
+#define RL_LOG_LEVEL_NONE 0
+#define RL_LOG_LEVEL_ERROR 1
+#define RL_LOG_LEVEL_WARN 2
+#define RL_LOG_LEVEL_INFO 3  // Startup, configuration and connection changes
+#define RL_LOG_LEVEL_DEBUG 4  // Every message sent and received
+#define RL_LOG_LEVEL_TRACE 5  // Every sample
+
+#ifndef RL_LOG_LEVEL
+#define RL_LOG_LEVEL RL_LOG_LEVEL_INFO
+#endif
+
+#ifndef RL_LOG_BUFFER_SIZE
+#define RL_LOG_BUFFER_SIZE 0  // Size of the deferred log buffer, 0 writes directly to Serial
+#endif
+
+class RLLogger : public Print
+{
+public:
+    size_t write(uint8_t c);
+    // Move buffered characters to Serial, as many as fit without blocking
+    void drain();
+    unsigned long Dropped = 0;  // Characters lost because the deferred buffer was full
+
+    template <typename T>
+    void line(const T& value)
+    {
+        print(value);
+        println();
+    }
+    template <typename T, typename... Rest>
+    void line(const T& value, const Rest&... rest)
+    {
+        print(value);
+        line(rest...);
+    }
+
+#if RL_LOG_BUFFER_SIZE > 0
+protected:
+    char Buffer[RL_LOG_BUFFER_SIZE];
+    unsigned int Head = 0;
+    unsigned int Count = 0;
+#endif
+};
+
+extern RLLogger RLLog;
+
+#if RL_LOG_LEVEL >= RL_LOG_LEVEL_ERROR
+#define RL_LOG_ERROR(...) RLLog.line(__VA_ARGS__)
+#else
+#define RL_LOG_ERROR(...) do {} while (0)
+#endif
+
+#if RL_LOG_LEVEL >= RL_LOG_LEVEL_WARN
+#define RL_LOG_WARN(...) RLLog.line(__VA_ARGS__)
+#else
+#define RL_LOG_WARN(...) do {} while (0)
+#endif
+
+#if RL_LOG_LEVEL >= RL_LOG_LEVEL_INFO
+#define RL_LOG_INFO(...) RLLog.line(__VA_ARGS__)
+#else
+#define RL_LOG_INFO(...) do {} while (0)
+#endif
+
+#if RL_LOG_LEVEL >= RL_LOG_LEVEL_DEBUG
+#define RL_LOG_DEBUG(...) RLLog.line(__VA_ARGS__)
+#else
+#define RL_LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if RL_LOG_LEVEL >= RL_LOG_LEVEL_TRACE
+#define RL_LOG_TRACE(...) RLLog.line(__VA_ARGS__)
+#else
+#define RL_LOG_TRACE(...) do {} while (0)
+#endif
+
+#endif
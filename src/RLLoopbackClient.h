@@ -0,0 +1,285 @@
+/**
+ * RLLoopbackClient.h
+ *
+ * In-memory Client that stands in for a network connection to an MQTT broker.
+ * Packets written by PubSubClient are parsed and answered locally, so RLNode can be
+ * run and measured without a network. Used by the benchmark example.
+ *
+ * Only what PubSubClient needs is implemented: CONNECT, SUBSCRIBE, UNSUBSCRIBE,
+ * PINGREQ and DISCONNECT are acknowledged, and QoS 0 PUBLISH messages are counted,
+ * passed to the publish handler and delivered back if the node subscribes to the topic.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLLoopbackClient_h
+#define RLLoopbackClient_h
+
+#include "Arduino.h"
+#include "Client.h"
+
+// Can be defined before including this file
+#ifndef LOOPBACK_BUFFER_SIZE
+#define LOOPBACK_BUFFER_SIZE 1024  // Should be at least the MQTT buffer size of the node
+#endif
+#ifndef LOOPBACK_MAX_SUBSCRIPTIONS
+#define LOOPBACK_MAX_SUBSCRIPTIONS 8
+#endif
+#ifndef LOOPBACK_MAX_TOPIC_LENGTH
+#define LOOPBACK_MAX_TOPIC_LENGTH 128
+#endif
+
+// Called for every message the node publishes
+#define LOOPBACK_PUBLISH_HANDLER void (*publishHandler)(const char* topic, const uint8_t* payload, unsigned int length)
+
+class RLLoopbackClient : public Client
+{
+public:
+    // Counters, reset with resetCounters()
+    unsigned long BytesWritten = 0;  // All bytes written by the node
+    unsigned long Publishes = 0;  // PUBLISH packets from the node
+    unsigned long PublishBytes = 0;  // Size of the PUBLISH packets, including header and topic
+
+    void setPublishHandler(LOOPBACK_PUBLISH_HANDLER) { this->publishHandler = publishHandler; }
+    void resetCounters()
+    {
+        BytesWritten = 0;
+        Publishes = 0;
+        PublishBytes = 0;
+    }
+
+    // Deliver a message to the node, if it is subscribed to the topic
+    bool inject(const char* topic, const char* payload)
+    {
+        return inject(topic, (const uint8_t*)payload, strlen(payload));
+    }
+    bool inject(const char* topic, const uint8_t* payload, unsigned int length)
+    {
+        if (!isSubscribed(topic))
+            return false;
+        unsigned int topicLength = strlen(topic);
+        unsigned int remaining = 2 + topicLength + length;
+        if (TxCount + remaining + 5 > LOOPBACK_BUFFER_SIZE)
+            return false;
+        pushTx(0x30);
+        do
+        {
+            uint8_t digit = remaining % 128;
+            remaining /= 128;
+            pushTx(remaining > 0 ? digit | 0x80 : digit);
+        } while (remaining > 0);
+        pushTx(topicLength >> 8);
+        pushTx(topicLength & 0xFF);
+        for (unsigned int i = 0; i < topicLength; i++)
+            pushTx(topic[i]);
+        for (unsigned int i = 0; i < length; i++)
+            pushTx(payload[i]);
+        return true;
+    }
+
+    // Simulate a lost connection
+    void drop()
+    {
+        Connected = false;
+        RxCount = 0;
+        TxCount = 0;
+        SubscriptionCount = 0;
+    }
+
+    // Client
+    int connect(IPAddress ip, uint16_t port) { return open(); }
+    int connect(const char* host, uint16_t port) { return open(); }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t* buf, size_t size)
+    {
+        if (!Connected)
+            return 0;
+        size_t written = 0;
+        while (written < size)
+        {
+            size_t length = size - written;
+            if (length > LOOPBACK_BUFFER_SIZE - RxCount)
+                length = LOOPBACK_BUFFER_SIZE - RxCount;
+            if (length == 0)
+                break;  // Packet larger than the buffer
+            memcpy(Rx + RxCount, buf + written, length);
+            RxCount += length;
+            written += length;
+            while (parsePacket()) {}
+        }
+        BytesWritten += written;
+        return written;
+    }
+    int available() { return TxCount; }
+    int read()
+    {
+        if (TxCount == 0)
+            return -1;
+        uint8_t b = Tx[TxHead];
+        TxHead = (TxHead + 1) % LOOPBACK_BUFFER_SIZE;
+        TxCount--;
+        return b;
+    }
+    int read(uint8_t* buf, size_t size)
+    {
+        size_t i = 0;
+        while (i < size && TxCount > 0)
+            buf[i++] = read();
+        return i;
+    }
+    int peek() { return TxCount ? Tx[TxHead] : -1; }
+    void flush() {}
+    void stop() { drop(); }
+    uint8_t connected() { return Connected; }
+    operator bool() { return Connected; }
+
+protected:
+    LOOPBACK_PUBLISH_HANDLER = NULL;
+    bool Connected = false;
+    uint8_t Rx[LOOPBACK_BUFFER_SIZE];  // Bytes from the node, until a complete packet is received
+    unsigned int RxCount = 0;
+    uint8_t Tx[LOOPBACK_BUFFER_SIZE];  // Ring buffer of bytes to the node
+    unsigned int TxHead = 0;
+    unsigned int TxCount = 0;
+    char Subscriptions[LOOPBACK_MAX_SUBSCRIPTIONS][LOOPBACK_MAX_TOPIC_LENGTH];
+    int SubscriptionCount = 0;
+
+    int open()
+    {
+        drop();
+        Connected = true;
+        return 1;
+    }
+
+    // Called for every message the node publishes, overridden by clients that answer the messages
+    virtual void onPublish(const char* topic, const uint8_t* payload, unsigned int length)
+    {
+        if (publishHandler != NULL)
+            publishHandler(topic, payload, length);
+    }
+
+    void pushTx(uint8_t b)
+    {
+        if (TxCount == LOOPBACK_BUFFER_SIZE)
+            return;
+        Tx[(TxHead + TxCount) % LOOPBACK_BUFFER_SIZE] = b;
+        TxCount++;
+    }
+
+    // Exact match, or MQTT wildcards + and # in the subscription
+    static bool topicMatches(const char* filter, const char* topic)
+    {
+        while (*filter && *topic)
+        {
+            if (*filter == '#')
+                return true;
+            if (*filter == '+')
+            {
+                while (*topic && *topic != '/')
+                    topic++;
+                filter++;
+                continue;
+            }
+            if (*filter != *topic)
+                return false;
+            filter++;
+            topic++;
+        }
+        return (*filter == *topic) || !strcmp(filter, "#") || !strcmp(filter, "/#");
+    }
+
+    bool isSubscribed(const char* topic)
+    {
+        for (int i = 0; i < SubscriptionCount; i++)
+        {
+            if (topicMatches(Subscriptions[i], topic))
+                return true;
+        }
+        return false;
+    }
+
+    // Copy the length prefixed string at data into str, returns the length including the prefix
+    static unsigned int readString(const uint8_t* data, char* str)
+    {
+        unsigned int length = (data[0] << 8) | data[1];
+        unsigned int copied = length < LOOPBACK_MAX_TOPIC_LENGTH ? length : LOOPBACK_MAX_TOPIC_LENGTH - 1;
+        memcpy(str, data + 2, copied);
+        str[copied] = '\0';
+        return length + 2;
+    }
+
+    // Handle the first packet in Rx if it is complete, returns false if more bytes are needed
+    bool parsePacket()
+    {
+        if (RxCount < 2)
+            return false;
+        unsigned int remaining = 0;
+        unsigned int multiplier = 1;
+        unsigned int header = 1;
+        do
+        {
+            if (header >= RxCount)
+                return false;
+            remaining += (Rx[header] & 0x7F) * multiplier;
+            multiplier *= 128;
+        } while (Rx[header++] & 0x80);
+        if (RxCount < header + remaining)
+            return false;
+
+        const uint8_t* body = Rx + header;
+        char topic[LOOPBACK_MAX_TOPIC_LENGTH];
+        switch (Rx[0] & 0xF0)
+        {
+        case 0x10:  // CONNECT
+            pushTx(0x20); pushTx(2); pushTx(0); pushTx(0);
+            break;
+        case 0x30:  // PUBLISH (QoS 0)
+        {
+            unsigned int topicLength = readString(body, topic);
+            Publishes++;
+            PublishBytes += header + remaining;
+            onPublish(topic, body + topicLength, remaining - topicLength);
+            inject(topic, body + topicLength, remaining - topicLength);
+            break;
+        }
+        case 0x80:  // SUBSCRIBE
+        {
+            readString(body + 2, topic);
+            bool subscribed = false;
+            for (int i = 0; i < SubscriptionCount; i++)
+                subscribed = subscribed || !strcmp(Subscriptions[i], topic);
+            if (!subscribed && SubscriptionCount < LOOPBACK_MAX_SUBSCRIPTIONS)
+            {
+                strcpy(Subscriptions[SubscriptionCount++], topic);
+                subscribed = true;
+            }
+            pushTx(0x90); pushTx(3); pushTx(body[0]); pushTx(body[1]); pushTx(subscribed ? 0 : 0x80);
+            break;
+        }
+        case 0xA0:  // UNSUBSCRIBE
+            readString(body + 2, topic);
+            for (int i = 0; i < SubscriptionCount; i++)
+            {
+                if (!strcmp(Subscriptions[i], topic))
+                {
+                    strcpy(Subscriptions[i], Subscriptions[--SubscriptionCount]);
+                    break;
+                }
+            }
+            pushTx(0xB0); pushTx(2); pushTx(body[0]); pushTx(body[1]);
+            break;
+        case 0xC0:  // PINGREQ
+            pushTx(0xD0); pushTx(0);
+            break;
+        case 0xE0:  // DISCONNECT
+            Connected = false;
+            break;
+        }
+        // Keep the bytes of the next packet
+        RxCount -= header + remaining;
+        memmove(Rx, Rx + header + remaining, RxCount);
+        return RxCount > 0;
+    }
+};
+
+#endif
@@ -0,0 +1,45 @@
+/**
+ * RLMemory.h
+ *
+ * Free memory between the heap and the stack, used by the examples to measure the memory
+ * used by nodes and the heap growth of the hot path, and on the host the bytes allocated.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLMemory_h
+#define RLMemory_h
+
+#include "Arduino.h"
+
+#ifdef __arm__
+extern "C" char* sbrk(int incr);
+#elif defined(__AVR__)
+extern char* __brkval;
+extern char* __malloc_heap_start;
+#endif
+
+// Free memory between the heap and the stack, -1 if not known for this board
+inline long freeMemory()
+{
+#ifdef __arm__
+    char top;
+    return &top - reinterpret_cast<char*>(sbrk(0));
+#elif defined(__AVR__)
+    char top;
+    return __brkval ? &top - __brkval : &top - __malloc_heap_start;
+#else
+    return -1;
+#endif
+}
+
+// Bytes allocated on the heap since start, -1 if not counted for this board
+// The host build in extras/host counts every malloc and new, freed memory is not subtracted
+#ifdef RLNODE_HOST
+long hostAllocatedBytes();
+inline long allocatedMemory() { return hostAllocatedBytes(); }
+#else
+inline long allocatedMemory() { return -1; }
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * RLMqttSession.cpp
+ *
+ * MQTT connection shared by the nodes of a process. Messages on node topics are routed
+ * to the node with the MAC in the topic, so any number of nodes can use one connection.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "RLNode.h"
+
+RLMqttSession RLDefaultSession;
+PubSubClient& mqttClient = RLDefaultSession.Mqtt;
+RLMqttSession* RLMqttSession::Active = NULL;
+
+// Hash of a MAC address, case insensitive since topics use both upper and lower case MACs
+static uint8_t macHash(const char* mac, size_t length)
+{
+    uint8_t hash = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = hash * 31 + tolower(mac[i]);
+    }
+    return hash & (SESSION_BUCKETS - 1);
+}
+
+static bool macEquals(const char* mac, size_t length, const char* lowerCaseMac)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (tolower(mac[i]) != lowerCaseMac[i])
+            return false;
+    }
+    return lowerCaseMac[length] == '\0';
+}
+
+void RLMqttSession::attach(RLNodeBase* node)
+{
+    uint8_t bucket = macHash(node->LowerCaseMAC, strlen(node->LowerCaseMAC));
+    for (RLNodeBase* attached = Buckets[bucket]; attached != NULL; attached = attached->NextInBucket)
+    {
+        if (attached == node)
+            return;
+    }
+    node->NextInBucket = Buckets[bucket];
+    Buckets[bucket] = node;
+    node->NextNode = Nodes;
+    Nodes = node;
+    NodeCount++;
+    Mqtt.setCallback(callback);
+}
+
+void RLMqttSession::detach(RLNodeBase* node)
+{
+    for (RLNodeBase** link = &Nodes; *link != NULL; link = &(*link)->NextNode)
+    {
+        if (*link == node)
+        {
+            *link = node->NextNode;
+            NodeCount--;
+            break;
+        }
+    }
+    uint8_t bucket = macHash(node->LowerCaseMAC, strlen(node->LowerCaseMAC));
+    for (RLNodeBase** link = &Buckets[bucket]; *link != NULL; link = &(*link)->NextInBucket)
+    {
+        if (*link == node)
+        {
+            *link = node->NextInBucket;
+            break;
+        }
+    }
+    node->NextNode = NULL;
+    node->NextInBucket = NULL;
+}
+
+void RLMqttSession::loop()
+{
+    RLMqttSession* previous = Active;
+    Active = this;
+    Mqtt.loop();
+    Active = previous;
+}
+
+// Makes at most one attempt per call, with jittered exponential backoff between failed attempts,
+// so the channels keep sampling into the sample store while the broker is down
+// Note: the attempt itself blocks for as long as Client::connect and the MQTT CONNACK take
+bool RLMqttSession::reconnect(const char* id, const char* username, const char* password)
+{
+    if (ReconnectAttempts > 0 && (long)(millis() - NextReconnectTime) < 0)
+        return false;
+
+    RL_LOG_INFO(F("Attempting to connect to MQTT broker..."));
+    if (Mqtt.connect(id, username, password))
+    {
+        RL_LOG_INFO(F("Connection to MQTT broker [Established]"));
+        ReconnectAttempts = 0;
+        Connections++;
+        return true;
+    }
+
+    // Double the delay for each failed attempt, and pick a random delay in [delay/2, delay]
+    // so nodes that lost the broker at the same time do not reconnect at the same time
+    unsigned long delayTime = RECONNECT_MAX_DELAY;
+    if (ReconnectAttempts < 16 && ((unsigned long)RECONNECT_MIN_DELAY << ReconnectAttempts) < RECONNECT_MAX_DELAY)
+        delayTime = (unsigned long)RECONNECT_MIN_DELAY << ReconnectAttempts;
+    delayTime = random(delayTime / 2, delayTime + 1);
+    ReconnectAttempts++;
+    NextReconnectTime = millis() + delayTime;
+
+    RL_LOG_WARN(F("Connection to MQTT broker [Failed], state "), Mqtt.state());
+    RL_LOG_WARN(F("  retrying in "), delayTime, F(" ms"));
+    return false;
+}
+
+void RLMqttSession::callback(char* topic, byte* payload, unsigned int length)
+{
+    if (Active != NULL)
+        Active->route(topic, payload, length);
+}
+
+// Node topics have the MAC as the third level (req/rtl/<mac>/..., res/rtl/<mac>/...)
+// or the second level (not/<MAC>/...), other topics are delivered to every node that handles them
+void RLMqttSession::route(char* topic, byte* payload, unsigned int length)
+{
+    RL_LOG_DEBUG(F("Recieved "), length, F("/"), Mqtt.getBufferSize(), F(" bytes on ("), topic, F(")."));
+
+    const char* mac = NULL;
+    if (!strncmp(topic, "req/rtl/", 8) || !strncmp(topic, "res/rtl/", 8))
+        mac = topic + 8;
+    else if (!strncmp(topic, "not/", 4))
+        mac = topic + 4;
+    if (mac != NULL)
+    {
+        const char* end = strchr(mac, '/');
+        RLNodeBase* node = end != NULL ? findNode(mac, end - mac) : NULL;
+        if (node != NULL)
+        {
+            node->mqttCallback(topic, payload, length);
+            return;
+        }
+    }
+
+    // Handlers parse the payload in place and replies overwrite the MQTT buffer,
+    // so every node gets its own copy of the topic and payload
+    if (NodeCount == 1)
+    {
+        Nodes->mqttCallback(topic, payload, length);
+        return;
+    }
+    if (length > SESSION_BROADCAST_SIZE || strlen(topic) >= MAX_TOPIC_LENGTH)
+    {
+        RL_LOG_WARN(F("Message on ("), topic, F(") too large to deliver to all nodes"));
+        return;
+    }
+    char topicCopy[MAX_TOPIC_LENGTH];
+    byte payloadCopy[SESSION_BROADCAST_SIZE];
+    strcpy(topicCopy, topic);
+    memcpy(payloadCopy, payload, length);
+    for (RLNodeBase* node = Nodes; node != NULL; node = node->NextNode)
+    {
+        if (!node->handlesTopic(topicCopy))
+            continue;
+        byte payloadNode[SESSION_BROADCAST_SIZE];
+        memcpy(payloadNode, payloadCopy, length);
+        node->mqttCallback(topicCopy, payloadNode, length);
+    }
+}
+
+RLNodeBase* RLMqttSession::findNode(const char* mac, size_t length)
+{
+    for (RLNodeBase* node = Buckets[macHash(mac, length)]; node != NULL; node = node->NextInBucket)
+    {
+        if (macEquals(mac, length, node->LowerCaseMAC))
+            return node;
+    }
+    return NULL;
+}
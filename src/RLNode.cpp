@@ -17,13 +17,9 @@
 
 #include "RLNode.h"
 
-PubSubClient mqttClient;
-// Stored in the heap, Used and then cleared for all json structures
-DynamicJsonDocument jsonDoc(MAX_JSON_SIZE);
-DynamicJsonDocument nodeInformation(MAX_JSON_SIZE);
 
 // dtosrt() and itoa() are not working on Arduino MKR1010 Wifi this function is used instead to convert int to char. 
-void intTochar(int int_current,char * outputString  )
+void intTochar(long int_current,char * outputString  )
 {
     // Check if negative 
     int negative_sign = 0;
@@ -34,13 +30,13 @@ void intTochar(int int_current,char * outputString  )
     }
     // Count how many digits 
     int n_digits=0; 
-    int abs_current = abs(int_current); 
+    unsigned long abs_current = labs(int_current); 
     do{
       n_digits++;
       abs_current = abs_current/10;
     }while(abs_current>0);
     // Write the number to char array backward 
-    abs_current = abs(int_current); // Restore the abs_current value from previous division. 
+    abs_current = labs(int_current); // Restore the abs_current value from previous division. 
     for (int i = n_digits-1+negative_sign; i>=0+negative_sign; i--)
     {
       *(outputString+i) = '0' + (abs_current % 10) ;
@@ -50,6 +46,73 @@ void intTochar(int int_current,char * outputString  )
     *(outputString + n_digits + negative_sign) = '\0';
 }
 
+// Fixed-point conversion of float to char with precision decimals, built on intTochar
+// Values that do not fit in a long, and NaN, are written as "NaN"
+void floatTochar(float value, int precision, char* outputString)
+{
+    static const unsigned long scales[MAX_PRECISION + 1] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    if (!(value > -2147483647.0f && value < 2147483647.0f))
+    {
+        strcpy(outputString, "NaN");
+        return;
+    }
+    precision = constrain(precision, 0, MAX_PRECISION);
+    unsigned long scale = scales[precision];
+
+    // Round at the last decimal, then write the integer part and the zero padded decimals
+    bool negative = value < 0;
+    if (negative)
+        value = -value;
+    unsigned long whole = (unsigned long)value;
+    unsigned long fraction = (unsigned long)((value - whole) * scale + 0.5f);
+    if (fraction >= scale)
+    {
+        whole++;
+        fraction -= scale;
+    }
+    if (negative && (whole > 0 || fraction > 0))
+        *outputString++ = '-';
+    intTochar(whole, outputString);
+    if (precision == 0)
+        return;
+    outputString += strlen(outputString);
+    *outputString++ = '.';
+    for (int i = precision - 1; i >= 0; i--)
+    {
+        outputString[i] = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    outputString[precision] = '\0';
+}
+
+// Collects bytes into chunks before they are written to target,
+// used to stream JSON to the MQTT client without writing one byte at a time
+class RLChunkedPrint : public Print
+{
+public:
+    RLChunkedPrint(Print& target) : Target(target) {}
+    size_t write(uint8_t c)
+    {
+        Chunk[Count++] = c;
+        if (Count == PUBLISH_CHUNK_SIZE)
+            sendChunk();
+        return 1;
+    }
+    // Write the buffered bytes, returns false if any write has failed
+    bool sendChunk()
+    {
+        if (Count > 0 && Target.write(Chunk, Count) != Count)
+            Failed = true;
+        Count = 0;
+        return !Failed;
+    }
+private:
+    Print& Target;
+    uint8_t Chunk[PUBLISH_CHUNK_SIZE];
+    size_t Count = 0;
+    bool Failed = false;
+};
+
 void strLow(char * inputStr)
 {
     while (*inputStr)
@@ -59,7 +122,6 @@ void strLow(char * inputStr)
     }
 }
 
-RLNode logNode;
 // ******************************************************************
 // Base channel class (Abstract)
 // Includes common functions and attributes needed for each channel
@@ -71,21 +133,126 @@ RLChannel::RLChannel(const char* type, const float maxSampleRate, SENSOR_FUNCTIO
     setSensorFunction(sensorFunction);
 }
 
+RLChannel::RLChannel(const char* type, const float maxSampleRate, FLOAT_SENSOR_FUNCTION)
+{
+    strcpy(Type, type);
+    MaxSampleRate = maxSampleRate;
+    setSensorFunction(floatSensorFunction);
+}
+
+RLChannel::RLChannel(const char* type, const float maxSampleRate, INT_SENSOR_FUNCTION)
+{
+    strcpy(Type, type);
+    MaxSampleRate = maxSampleRate;
+    setSensorFunction(intSensorFunction);
+}
+
 // Sets given sensor reading function as sensorReader for the given channel
 RLChannel& RLChannel::setSensorFunction(SENSOR_FUNCTION)
 {
     this->sensorFunction = sensorFunction;
+    this->floatSensorFunction = NULL;
+    this->intSensorFunction = NULL;
+    return *this;
+}
+RLChannel& RLChannel::setSensorFunction(FLOAT_SENSOR_FUNCTION)
+{
+    this->sensorFunction = NULL;
+    this->floatSensorFunction = floatSensorFunction;
+    this->intSensorFunction = NULL;
+    return *this;
+}
+RLChannel& RLChannel::setSensorFunction(INT_SENSOR_FUNCTION)
+{
+    this->sensorFunction = NULL;
+    this->floatSensorFunction = NULL;
+    this->intSensorFunction = intSensorFunction;
+    return *this;
+}
+
+// Read the sensor into outputString, returns the value as a number
+// Values from typed sensor functions are calibrated and formatted here,
+// strings from the string sensor function are only parsed if the value is needed
+float RLChannel::readSensor(char* outputString, bool* forcePublish)
+{
+    if (floatSensorFunction != NULL)
+        return formatValue(floatSensorFunction(forcePublish), outputString);
+    if (intSensorFunction != NULL)
+        return formatValue(intSensorFunction(forcePublish), outputString);
+    sensorFunction(outputString, CalibrationValueK, CalibrationValueM, forcePublish);
+    return (WindowPeriod > 0 || Deadband > 0.0f) ? atof(outputString) : 0.0f;
+}
+
+// Calibrate a raw value from a typed sensor function and format it into outputString
+float RLChannel::formatValue(float raw, char* outputString)
+{
+    float value = raw * CalibrationValueK + CalibrationValueM;
+    floatTochar(value, Precision, outputString);
+    return value;
+}
+float RLChannel::formatValue(int32_t raw, char* outputString)
+{
+    if (CalibrationValueK == 1.0f && CalibrationValueM == 0.0f)
+    {
+        intTochar(raw, outputString);  // Exact, also for values beyond the precision of a float
+        return raw;
+    }
+    return formatValue((float)raw, outputString);
+}
+
+RLChannel& RLChannel::setAcquisitionBuffer(RLAcquisitionBuffer* buffer)
+{
+    Acquisition = buffer;
+    if (Node != NULL)
+        Node->rescheduleChannels();
     return *this;
 }
 
+// Read the sensor and buffer the raw value, called from a timer interrupt
+// Returns false if the channel is not active or the buffer is full
+bool RLChannel::acquireFromISR()
+{
+    if (Acquisition == NULL || !Active)
+        return false;
+    RLAcquiredSample sample;
+    sample.Time = millis();
+    sample.Force = false;
+    if (floatSensorFunction != NULL)
+        sample.FloatValue = floatSensorFunction(&sample.Force);
+    else if (intSensorFunction != NULL)
+        sample.IntValue = intSensorFunction(&sample.Force);
+    else
+        return false;  // String sensor functions are not called from interrupts
+    return Acquisition->push(sample);
+}
+
+void RLChannel::drainAcquisition()
+{
+    RLAcquiredSample sample;
+    char outputString[MAX_GENERAL_STRING_LENGTH];
+    while (Acquisition->pop(sample))
+    {
+        // Samples from before the configuration, and during the activation delay, are dropped
+        if (!Active || (long)(sample.Time - ActivationTime) < CHANNEL_ACTIVATION_DELAY)
+            continue;
+        float value;
+        if (floatSensorFunction != NULL)
+            value = formatValue(sample.FloatValue, outputString);
+        else
+            value = formatValue(sample.IntValue, outputString);
+        Diagnostics.Samples++;
+        processSample(outputString, value, sample.Force, sample.Time);
+    }
+}
+
 // Add/update channel information to JSON structure, using ID as index in nested array
 // Used at startup when sending channel properties to database
 void RLChannel::addChannelPropertiesByID()
 {
-    nodeInformation["Payload"]["Channel"]["ChannelId"] = ID;
-    nodeInformation["Payload"]["Channel"]["Type"] = Type;
-    nodeInformation["Payload"]["Channel"]["MaxSampleRate"] = MaxSampleRate;
-    //nodeInformation["Payload"]["Channel"]["Sensor_ID"] = Sensor_ID;
+    Node->NodeInformation["Payload"]["Channel"]["ChannelId"] = ID;
+    Node->NodeInformation["Payload"]["Channel"]["Type"] = Type;
+    Node->NodeInformation["Payload"]["Channel"]["MaxSampleRate"] = MaxSampleRate;
+    //Node->NodeInformation["Payload"]["Channel"]["Sensor_ID"] = Sensor_ID;
 
 }
 
@@ -99,66 +266,174 @@ void RLChannel::updateConfig()
     // and SampleRate is not higher than MaxSampleRate
     // and SampleRate is not negative (or 0)
 
-    if (!jsonDoc["Payload"]["Configuration"]["PublishTopic"].isNull() &&
-        strlen(jsonDoc["Payload"]["Configuration"]["PublishTopic"]) > 0 &&
-        MaxSampleRate >= jsonDoc["Payload"]["Configuration"]["SampleRate"] &&
-        0 < jsonDoc["Payload"]["Configuration"]["SampleRate"])
+    // A new configuration starts a new batch and window, nothing is published here
+    // since JsonDoc points into the MQTT buffer, batched samples are moved to the sample store instead
+    for (int i = 0; i < BatchCount; i++)
+    {
+        Node->storeSample(ID, Batch[(BatchHead + i) % MAX_BATCH_SIZE]);
+    }
+    BatchHead = 0;
+    BatchCount = 0;
+    clearWindow();
+
+    if (!Node->JsonDoc["Payload"]["Configuration"]["PublishTopic"].isNull() &&
+        strlen(Node->JsonDoc["Payload"]["Configuration"]["PublishTopic"]) > 0 &&
+        MaxSampleRate >= Node->JsonDoc["Payload"]["Configuration"]["SampleRate"] &&
+        0 < Node->JsonDoc["Payload"]["Configuration"]["SampleRate"])
     {
         
-        if (jsonDoc["Payload"]["Configuration"]["PublishTopic"].is<const char*>()){
-            strcpy(PublishTopic, jsonDoc["Payload"]["Configuration"]["PublishTopic"]);
+        // The old topic is removed first, so its room in the topic pool can be used by the new topic
+        Node->TopicPool.remove(PublishTopic);
+        // Publish topics are built into Topic_Scratch of the node when they are used, so they must fit in it
+        if (Node->JsonDoc["Payload"]["Configuration"]["PublishTopic"].is<const char*>() &&
+            strlen(Node->JsonDoc["Payload"]["Configuration"]["PublishTopic"]) < Node->TopicLength){
+            PublishTopic = Node->TopicPool.add(Node->JsonDoc["Payload"]["Configuration"]["PublishTopic"]);
         }
         else{
-            strcpy(PublishTopic, "");
+            PublishTopic = TOPIC_NONE;
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["SampleRate"].is<float>()){
-            SampleRate = jsonDoc["Payload"]["Configuration"]["SampleRate"];
+        if (Node->JsonDoc["Payload"]["Configuration"]["SampleRate"].is<float>()){
+            SampleRate = Node->JsonDoc["Payload"]["Configuration"]["SampleRate"];
         }
         else{
              SampleRate = 0;
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["kValue"].is<float>()){
-            CalibrationValueK = jsonDoc["Payload"]["Configuration"]["kValue"];
+        if (PublishTopic == TOPIC_NONE){
+            RL_LOG_ERROR(F("[Error] Publish topic of channel "), ID, F(" does not fit in the topic pool"));
+            SampleRate = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["kValue"].is<float>()){
+            CalibrationValueK = Node->JsonDoc["Payload"]["Configuration"]["kValue"];
         }
         else{
-             CalibrationValueK = 0;
+             CalibrationValueK = 1;
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["mValue"].is<float>()){
-            CalibrationValueM = jsonDoc["Payload"]["Configuration"]["mValue"];
+        if (Node->JsonDoc["Payload"]["Configuration"]["mValue"].is<float>()){
+            CalibrationValueM = Node->JsonDoc["Payload"]["Configuration"]["mValue"];
         }
         else{
              CalibrationValueM = 0;
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["Unit"].is<const char*>()){
-            strcpy(Unit, jsonDoc["Payload"]["Configuration"]["Unit"]);
+        if (Node->JsonDoc["Payload"]["Configuration"]["Unit"].is<const char*>()){
+            strcpy(Unit, Node->JsonDoc["Payload"]["Configuration"]["Unit"]);
         }
         else{
             strcpy(Unit, "");
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["Descriptor"].is<const char*>()){
-            strcpy(Description, jsonDoc["Payload"]["Configuration"]["Descriptor"]);
+        if (Node->JsonDoc["Payload"]["Configuration"]["Descriptor"].is<const char*>()){
+            strcpy(Description, Node->JsonDoc["Payload"]["Configuration"]["Descriptor"]);
         }
         else{
             strcpy(Description, "");
         }
 
-        if (jsonDoc["Payload"]["Configuration"]["Sensor_ID"].is<const char*>()){
-            strcpy(Sensor_ID, jsonDoc["Payload"]["Configuration"]["Sensor_ID"]);
+        if (Node->JsonDoc["Payload"]["Configuration"]["Sensor_ID"].is<const char*>()){
+            strcpy(Sensor_ID, Node->JsonDoc["Payload"]["Configuration"]["Sensor_ID"]);
         }
         else{
             strcpy(Sensor_ID, "");
         }
 
-        Serial.println(SampleRate);
+        if (Node->JsonDoc["Payload"]["Configuration"]["Precision"].is<int>()){
+            Precision = constrain((int)Node->JsonDoc["Payload"]["Configuration"]["Precision"], 0, MAX_PRECISION);
+        }
+        else{
+            Precision = DEFAULT_PRECISION;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["BatchSize"].is<int>()){
+            BatchSize = constrain((int)Node->JsonDoc["Payload"]["Configuration"]["BatchSize"], 1, MAX_BATCH_SIZE);
+        }
+        else{
+            BatchSize = 1;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["BatchInterval"].is<unsigned long>()){
+            BatchInterval = Node->JsonDoc["Payload"]["Configuration"]["BatchInterval"];
+        }
+        else{
+            BatchInterval = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["Deadband"].is<float>()){
+            Deadband = Node->JsonDoc["Payload"]["Configuration"]["Deadband"];
+        }
+        else{
+            Deadband = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["DeadbandMode"] == "Relative"){
+            DeadbandMode = DEADBAND_RELATIVE;
+        }
+        else{
+            DeadbandMode = DEADBAND_ABSOLUTE;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["Heartbeat"].is<unsigned long>()){
+            Heartbeat = Node->JsonDoc["Payload"]["Configuration"]["Heartbeat"];
+        }
+        else{
+            Heartbeat = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["PublishRate"].is<float>() &&
+            Node->JsonDoc["Payload"]["Configuration"]["PublishRate"] < SampleRate &&
+            Node->JsonDoc["Payload"]["Configuration"]["PublishRate"] <= MAX_PUBLISH_RATE){
+            PublishRate = Node->JsonDoc["Payload"]["Configuration"]["PublishRate"];
+        }
+        else{
+            PublishRate = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["Timestamps"].is<bool>()){
+            Timestamps = Node->JsonDoc["Payload"]["Configuration"]["Timestamps"];
+        }
+        else{
+            Timestamps = false;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["Priority"].is<int>()){
+            Priority = Node->JsonDoc["Payload"]["Configuration"]["Priority"];
+        }
+        else{
+            Priority = 0;
+        }
+
+        if (Node->JsonDoc["Payload"]["Configuration"]["Encoding"] == "Binary"){
+            Encoding = ENCODING_BINARY;
+        }
+        else{
+            Encoding = ENCODING_TEXT;
+        }
+
+        JsonArray reducers = Node->JsonDoc["Payload"]["Configuration"]["Reducers"];
+        if (reducers.size() > 0){
+            Reducers = 0;
+            for (size_t i = 0; i < reducers.size(); i++){
+                if (reducers[i] == "Min") Reducers |= REDUCER_MIN;
+                else if (reducers[i] == "Max") Reducers |= REDUCER_MAX;
+                else if (reducers[i] == "Mean") Reducers |= REDUCER_MEAN;
+                else if (reducers[i] == "RMS") Reducers |= REDUCER_RMS;
+                else if (reducers[i] == "Count") Reducers |= REDUCER_COUNT;
+            }
+        }
+        else{
+            Reducers = DEFAULT_REDUCERS;
+        }
+
+        RL_LOG_DEBUG(SampleRate);
     }
     else
     {
         SampleRate = 0.0;
+        Node->TopicPool.remove(PublishTopic);
+        PublishTopic = TOPIC_NONE;
     }
 
     // If sample rate is 0, deactivate channel and set status to idle
@@ -167,481 +442,1933 @@ void RLChannel::updateConfig()
         Active = false;
         strcpy(Status, "Idle");
     }
-    else  // Set channel as active, status as online, and set activation timePreviousTime
+    else  // Set channel as active, status as online, and schedule the first sample
     {
         Active = true;
         strcpy(Status, "Online");
         ActivationTime = millis();
-        Serial.print(F("  Channel "));
-        Serial.print(ID);
-        Serial.print(F(" started publishing on topic "));
-        Serial.println(PublishTopic);
-        Serial.print(F("  Sample rate: "));
-        Serial.print(SampleRate);
-        Serial.println(F(" Samples/sec"));
+        // Period in fixed point, exact for sample rates with a resolution of 1 mHz
+        unsigned long milliHertz = (unsigned long)(SampleRate * 1000.0f + 0.5f);
+        if (milliHertz > 0)
+            Period = MICROS_TO_TICKS(1000000000UL) / milliHertz;
+        else
+            Period = (uint64_t)(1000000.0f / SampleRate * (1UL << SCHEDULER_FRACTION_BITS));
+        if (Period == 0)
+            Period = 1;
+        // Wait CHANNEL_ACTIVATION_DELAY after configuration (according to guidelines)
+        NextDueTime = Node->schedulerTime() + MICROS_TO_TICKS(CHANNEL_ACTIVATION_DELAY * 1000UL);
+        // Rounded to whole ms, PublishRate is at most MAX_PUBLISH_RATE so a window is never 0 ms
+        WindowPeriod = PublishRate > 0 ? (unsigned long)(1000.0f / PublishRate + 0.5f) : 0;
+        WindowStart = ActivationTime + CHANNEL_ACTIVATION_DELAY;
+        RL_LOG_INFO(F("  Channel "), ID, F(" started publishing on topic "), getPublishTopic());
+        RL_LOG_INFO(F("  Sample rate: "), SampleRate, F(" Samples/sec"));
     }
+    Forced = false;
+    if (Node != NULL)
+        Node->rescheduleChannels();
+}
+
+// Request a sample outside of the regular schedule,
+// the channel is sampled on the next loop (but never before the activation delay has passed)
+void RLChannel::forcePublish()
+{
+    if (!Active || Node == NULL)
+        return;
+    uint64_t now = Node->schedulerTime();
+    Forced = true;
+    if ((int64_t)(NextDueTime - now) > 0 && millis() - ActivationTime >= CHANNEL_ACTIVATION_DELAY)
+        NextDueTime = now;
+    Node->rescheduleChannels();
 }
 
-// Publishes data for active channels
-// Called every loop cycle
+// Reads the sensor and publishes the value
+// Called by the node scheduler when the channel is due
 void RLChannel::publishData()
 {
     // Only let activated channels publish,
-    // wait 1 second after configuration (according to guidelines),
-    // publish every period (set by sample rate),
-    // or when forced to publish,
-    // and make sure to never publish multiple times at once
-    
+    // and publish every period (set by sample rate) or when forced to publish
+    if (!Active)
+        return;
+
     char outputString[MAX_GENERAL_STRING_LENGTH];
     bool forcePublish = false;
-    Serial.println(F("Triggering sensor function"));
-    sensorFunction(outputString, CalibrationValueK, CalibrationValueM, &forcePublish);
-    if (Active &&
-        logNode.Time-ActivationTime >= 1000 &&
-        ((unsigned long)(logNode.Time - PreviousTime) >= (1000/SampleRate) || forcePublish))
+    if (!Forced)
+        Diagnostics.Jitter.add((unsigned long)((Node->Clock - NextDueTime) >> SCHEDULER_FRACTION_BITS));
+    RL_LOG_TRACE(F("Triggering sensor function"));
+    unsigned long sensorTime = micros();
+    float value = readSensor(outputString, &forcePublish);
+    Diagnostics.SensorTime.add(micros() - sensorTime);
+    Diagnostics.Samples++;
+
+    processSample(outputString, value, forcePublish, Node->Time);
+
+    // Advance the deadline one period,
+    // a forced sample restarts the period and a channel that has fallen behind skips the missed samples
+    if (Forced || (int64_t)(Node->Clock - NextDueTime) >= (int64_t)Period)
+        NextDueTime = Node->Clock + Period;
+    else
+        NextDueTime += Period;
+    Forced = false;
+}
+
+// Publish a sample read at time, through aggregation, deadband and batching
+void RLChannel::processSample(const char* outputString, float value, bool forcePublish, unsigned long time)
+{
+    // Aggregated channels publish once per window, other channels publish the sample
+    // The sensor function can set forcePublish to publish a value inside the deadband
+    // Under congestion decimated channels skip samples, forced samples are always published
+    uint8_t keep = decimation();
+    if (WindowPeriod > 0)
+    {
+        addToWindow(value, time);
+    }
+    else if (!Forced && !forcePublish && (keep == 0 || DecimationCount++ % keep != 0))
+    {
+        Diagnostics.Decimated++;
+    }
+    else if (!Forced && !forcePublish && !isException(outputString, value))
+    {
+        Diagnostics.Suppressed++;
+    }
+    else
+    {
+        if (BatchSize > 1 || BatchInterval > 0 || Timestamps || Encoding == ENCODING_BINARY ||
+            Node->Congestion >= CONGESTION_BATCH)
+        {
+            addToBatch(outputString, time);
+        }
+        else
+        {
+            // Samples batched during congestion are published first
+            if (BatchCount > 0)
+                publishBatch();
+            RL_LOG_TRACE(F("Publishing sensor data: "), outputString);
+            if (Node->mqttPublishData(getPublishTopic(), outputString))
+            {
+                Diagnostics.Publishes++;
+                RL_LOG_TRACE(F("Data published"));
+            }
+            else
+            {
+                Diagnostics.PublishFailures++;
+                RLSample sample;
+                sample.Time = time;
+                strcpy(sample.Value, outputString);
+                Node->storeSample(ID, sample);
+            }
+        }
+        strcpy(PreviousOutputString, outputString);
+        PreviousValue = value;
+        PreviousTime = time;
+    }
+}
+
+// True if value should be published according to the deadband and heartbeat of the channel
+bool RLChannel::isException(const char* outputString, float value)
+{
+    if (Deadband <= 0.0f && Heartbeat == 0)
+        return true;
+    if (PreviousOutputString[0] == '\0')
+        return true;  // Nothing published since the channel was configured
+    if (Heartbeat > 0 && Node->Time - PreviousTime >= Heartbeat)
+        return true;
+    if (Deadband <= 0.0f)
+        return strcmp(outputString, PreviousOutputString) != 0;
+    float band = Deadband;
+    if (DeadbandMode == DEADBAND_RELATIVE)
+        band *= fabs(PreviousValue);
+    return fabs(value - PreviousValue) > band;
+}
+
+// Add a sample read at time to its window, a sample at or after the end of the window starts the next window
+// The time of the sample is used, samples drained from the acquisition buffer are older than Node->Time
+void RLChannel::addToWindow(float value, unsigned long time)
+{
+    if ((long)(time - WindowStart) >= (long)WindowPeriod)
     {
-        Serial.print(F("Publishing sensor data: "));
-        Serial.println(outputString);
-        logNode.mqttPublishData(PublishTopic, outputString);
-        strcpy(PreviousOutputString,outputString);
-        PreviousTime = logNode.Time;
-        Serial.println(F("Data published"));
+        if (WindowCount > 0)
+            publishWindow();
+        // Keep the window grid unless the channel has fallen more than a window behind
+        WindowStart += WindowPeriod;
+        if ((long)(time - WindowStart) >= (long)WindowPeriod)
+            WindowStart = time;
     }
 
+    if (WindowCount == 0 || value < WindowMin)
+        WindowMin = value;
+    if (WindowCount == 0 || value > WindowMax)
+        WindowMax = value;
+    WindowSum += value;
+    WindowSumSquares += (double)value * value;
+    WindowCount++;
 }
 
-// ****************************************************************
-// RLNode class
-// Handles the node as a whole and contains a list of connected channels
-void RLNode::begin(Client& client, const char* mac, const char* server, uint16_t port)
+// Publish the reducers of the current window as {"Window":ms,"Min":v,...} and start a new window
+bool RLChannel::publishWindow()
 {
-    begin(client, mac, server, port, NULL, NULL, "", "");
+    char payload[AGGREGATE_PAYLOAD_SIZE];
+    JsonDocument& message = Node->NodeInformation;
+    message.clear();
+    message["Window"] = WindowPeriod;
+    char time[EPOCH_TIME_LENGTH];
+    if (Node->formatEpochTime(WindowStart, time))
+        message["Time"] = serialized((const char*)time);
+    if (Reducers & REDUCER_MIN)
+        message["Min"] = WindowMin;
+    if (Reducers & REDUCER_MAX)
+        message["Max"] = WindowMax;
+    if (Reducers & REDUCER_MEAN)
+        message["Mean"] = WindowSum / WindowCount;
+    if (Reducers & REDUCER_RMS)
+        message["RMS"] = sqrt(WindowSumSquares / WindowCount);
+    if (Reducers & REDUCER_COUNT)
+        message["Count"] = WindowCount;
+    // A truncated message would not be valid JSON, it is counted as a failed publish instead
+    bool fits = measureJson(message) < sizeof(payload);
+    if (fits)
+        serializeJson(message, payload, sizeof(payload));
+    message.clear();
+    clearWindow();
+    if (!fits)
+    {
+        RL_LOG_ERROR(F("[Error] Window of channel "), ID, F(" does not fit in AGGREGATE_PAYLOAD_SIZE"));
+        Diagnostics.PublishFailures++;
+        return false;
+    }
+
+    bool published = Node->mqttPublishData(getPublishTopic(), payload);
+    if (published)
+        Diagnostics.Publishes++;
+    else
+        Diagnostics.PublishFailures++;  // Windows are not kept in the sample store
+    return published;
 }
-void RLNode::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* nodename)
+void RLChannel::clearWindow()
 {
-    begin(client, mac, server, port, NULL, NULL, nodename, "");
+    WindowCount = 0;
+    WindowSum = 0.0;
+    WindowSumSquares = 0.0;
 }
-void RLNode::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
-                   const char* password)
+
+// Add a sample to the batch ring buffer and publish the batch when it is full or old enough
+// If the buffer is full (e.g. failed publish) the oldest sample is overwritten
+void RLChannel::addToBatch(const char* value, unsigned long time)
 {
-    begin(client, mac, server, port, username, password, "", "");
+    int index = (BatchHead + BatchCount) % MAX_BATCH_SIZE;
+    if (BatchCount == MAX_BATCH_SIZE)
+        BatchHead = (BatchHead + 1) % MAX_BATCH_SIZE;
+    else
+        BatchCount++;
+    Batch[index].Time = time;
+    strncpy(Batch[index].Value, value, MAX_GENERAL_STRING_LENGTH - 1);
+    Batch[index].Value[MAX_GENERAL_STRING_LENGTH - 1] = '\0';
+
+    // Under congestion batches are filled up
+    int batchSize = Node->Congestion >= CONGESTION_BATCH ? MAX_BATCH_SIZE : BatchSize;
+    if (BatchCount >= batchSize)
+        publishBatch();
+    else
+        flushBatch();
 }
-void RLNode::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
-                   const char* password, const char* nodename)
+
+void RLChannel::flushBatch()
 {
-    begin(client, mac, server, port, username, password, nodename, "");
+    if (BatchCount > 0 && batchTimeLeft() == 0)
+        publishBatch();
 }
-void RLNode::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
-                   const char* password, const char* nodename, const char* nodetype)
+
+// Under congestion batches are not held for longer than CONGESTION_BATCH_INTERVAL
+unsigned long RLChannel::batchTimeLeft()
 {
-    randomSeed(millis()*micros());  // Used for generating correlationdata
-    
-    // Set Mac address, mqtt username, mqtt password, and nodename
-    strncpy(MAC, mac, strlen(mac) + 1);
-    strncpy(MQTTUsername, username, strlen(username) + 1);
-    strncpy(MQTTPassword, password, strlen(password) + 1);
-    strncpy(NodeName, nodename, strlen(nodename) + 1);
-    strncpy(NodeType, nodetype, strlen(nodetype) + 1);
-    
-    // Create lower case MAC address for use in topics
-    strncpy(LowerCaseMAC, MAC, strlen(MAC) + 1);
-    strLow(LowerCaseMAC);
+    unsigned long interval = BatchInterval;
+    if (Node->Congestion >= CONGESTION_BATCH && (interval == 0 || interval > CONGESTION_BATCH_INTERVAL))
+        interval = CONGESTION_BATCH_INTERVAL;
+    if (BatchCount == 0 || interval == 0)
+        return SCHEDULER_IDLE_TIME;
+    unsigned long age = Node->Time - Batch[BatchHead].Time;
+    return age >= interval ? 0 : interval - age;
+}
 
-    mqttClient.setClient(client);
-    // Set the MQTT server
-    mqttClient.setServer(server, port);
+// Samples per published sample in the current congestion stage, 0 if the samples are dropped
+// Aggregated channels already publish at PublishRate and are not decimated,
+// and during an outage every sample goes to the sample store
+uint8_t RLChannel::decimation()
+{
+    if (WindowPeriod > 0 || Node->Congestion < CONGESTION_DECIMATE || !Node->Session->Mqtt.connected())
+        return 1;
+    bool low = Priority < Node->MaxPriority;
+    if (Node->Congestion == CONGESTION_DECIMATE)
+        return low ? CONGESTION_DECIMATION : 1;
+    return low ? 0 : CONGESTION_DECIMATION;
+}
 
-    // Establish the subscribe event, set keepalive time, and set buffer size
-    mqttClient.setCallback(RLNodeMqttCallback);
-    mqttClient.setKeepAlive(30);
-    if (mqttClient.setBufferSize(812))
-    {
-        Serial.print(F("  MQTT buffer size set to "));
-        Serial.println(mqttClient.getBufferSize());
-    }
-    else
+const char* RLChannel::getPublishTopic()
+{
+    if (Node == NULL)
+        return "";
+    Node->TopicPool.build(PublishTopic, Node->Topic_Scratch, Node->TopicLength);
+    return Node->Topic_Scratch;
+}
+
+float RLChannel::effectiveRate()
+{
+    if (!Active || Node == NULL)
+        return 0.0f;
+    // Aggregated channels publish one message per window
+    if (WindowPeriod > 0)
+        return 1000.0f / WindowPeriod;
+    uint8_t keep = decimation();
+    if (keep == 0)
+        return 0.0f;
+    // Lowered by the share of the samples kept after decimation that the deadband has suppressed
+    // since the latest diagnostics message
+    float rate = SampleRate / keep;
+    unsigned long kept = Diagnostics.Samples - Diagnostics.Decimated;
+    if (kept > 0 && Diagnostics.Suppressed <= kept)
+        rate *= (float)(kept - Diagnostics.Suppressed) / kept;
+    return rate;
+}
+
+static void reverseSamples(RLSample* samples, int first, int last)
+{
+    while (first < last)
     {
-        Serial.println(F("[Error] Not enough memory for MQTT buffer"));
-        while (true) { delay(1000); }
+        RLSample sample = samples[first];
+        samples[first++] = samples[last];
+        samples[last--] = sample;
     }
+}
 
-    // Attempt to connect to the server with mac address as ID
-    while (!mqttClient.connect(mac, MQTTUsername, MQTTPassword))
+// Publish all samples in the batch as one message, the buffer is emptied on success
+// Samples that could not be published are moved to the node sample store
+bool RLChannel::publishBatch()
+{
+    // The ring only wraps when it is full, rotate it so the samples start at Batch[0]
+    if (BatchHead != 0)
     {
-        Serial.println(F("  Connection to MQTT Broker [Failed]"));
-        Serial.println(F("    retrying in 2 seconds"));
-        delay(2000);
+        reverseSamples(Batch, 0, BatchHead - 1);
+        reverseSamples(Batch, BatchHead, MAX_BATCH_SIZE - 1);
+        reverseSamples(Batch, 0, MAX_BATCH_SIZE - 1);
+        BatchHead = 0;
     }
-    Serial.println(F("  Connection to MQTT Broker [Established]"));
 
-    // Publish an identification broadcast at startup
-    while (!SetNodeStartupInfo())
+    bool published = Node->publishSamples(*this, Batch, BatchCount);
+    if (published)
     {
-        delay(10000);
+        Diagnostics.Publishes++;
     }
-    Serial.println(F("  Startup information sent"));
-
-    // Set topic names and subscribe to them
-    setSubscriptionTopicNames();
-    mqttClient.subscribe(Topic_IdentificationPoll);
-    mqttClient.subscribe(Topic_SetNodeConfig);
-    mqttClient.subscribe(Topic_SetChannelConfig);
-    mqttClient.subscribe(Topic_NodeConfigChanged);
-
-    while (!SetChannelProperties())
+    else
     {
-        delay(10000);
+        Diagnostics.PublishFailures++;
+        for (int i = 0; i < BatchCount; i++)
+        {
+            Node->storeSample(ID, Batch[(BatchHead + i) % MAX_BATCH_SIZE]);
+        }
     }
-    Serial.println(F("  Set Channel Properties completed"));
-    
-    while (!GetChannelConfig())
+    BatchHead = 0;
+    BatchCount = 0;
+    return published;
+}
+
+// Add the channel counters to JSON structure and clear them
+void RLChannel::addDiagnostics()
+{
+    Node->NodeInformation["ChannelId"] = ID;
+    Node->NodeInformation["SampleRate"] = Active ? SampleRate : 0.0f;
+    Node->NodeInformation["Samples"] = Diagnostics.Samples;
+    Node->NodeInformation["Publishes"] = Diagnostics.Publishes;
+    Node->NodeInformation["PublishFailures"] = Diagnostics.PublishFailures;
+    Node->NodeInformation["Suppressed"] = Diagnostics.Suppressed;
+    Node->NodeInformation["Decimated"] = Diagnostics.Decimated;
+    Node->NodeInformation["EffectiveRate"] = effectiveRate();
+    if (Acquisition != NULL)
+        Node->NodeInformation["AcquisitionDropped"] = Acquisition->Dropped;
+    JsonArray sensorTime = Node->NodeInformation.createNestedArray("SensorTime");
+    JsonArray jitter = Node->NodeInformation.createNestedArray("Jitter");
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
     {
-        delay(10000);
+        sensorTime.add(Diagnostics.SensorTime.Counts[i]);
+        jitter.add(Diagnostics.Jitter.Counts[i]);
     }
-    Serial.println(F("  Channel configuration completed"));
+    memset(&Diagnostics, 0, sizeof(Diagnostics));
 }
 
-// Append list of channels with newChannel
-void RLNode::addChannel(RLChannel* newChannel)
+// ******************************************************************
+// Histogram
+void RLHistogram::add(unsigned long value)
 {
-    Channels[ChannelCount] = newChannel;
-    (*newChannel).ID = ChannelCount+1;
-    Serial.print(F("  Added channel with ID: "));
-    Serial.println((*newChannel).ID);
-    ChannelCount++;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value >= (1UL << (2 * bucket)))
+        bucket++;
+    // Saturate instead of wrapping around
+    if (Counts[bucket] < 0xFFFF)
+        Counts[bucket]++;
 }
 
-// Update loop: calls publishData for each connected channel and checks for MQTT messages
-void RLNode::loop()
+void RLHistogram::clear()
 {
-    unsigned long t = millis();
-    // Reconnect to the mqtt broker in the case of a disconnect
-    if (!mqttClient.connected())
-    {
-        RLNodeMqttReconnect(MAC);
-    }
-    // Check for incoming messages
-    mqttClient.loop();
-    Time = millis();  // Time set here to enable multiple channels with same sample rate
-    // Call loop function for each channel
-    for (int i=0; i<ChannelCount; i++)
+    memset(Counts, 0, sizeof(Counts));
+}
+
+// ******************************************************************
+// Sample messages, used for batches and stored samples
+// Format: {"Age":<ms since first sample>,"Samples":[[<ms after first sample>,"<value>"],...]}
+// Channels with the binary encoding publish the same content in the format of RLBinaryCodec.h
+void beginSampleMessage(char* payload, unsigned long firstTime, RLNodeBase& node)
+{
+    char number[EPOCH_TIME_LENGTH];
+    strcpy(payload, "{\"Age\":");
+    intTochar((long)(millis() - firstTime), number);
+    strcat(payload, number);
+    if (node.formatEpochTime(firstTime, number))
     {
-        (*Channels[i]).publishData();
+        strcat(payload, ",\"Time\":");
+        strcat(payload, number);
     }
+    strcat(payload, ",\"Samples\":[");
 }
 
-// Create and send startup information
-int RLNode::SetNodeStartupInfo()
+void appendSampleMessage(char* payload, const RLSample& sample, unsigned long firstTime, bool first)
 {
-    // Fill in general node information 
-    strcpy(Topic_Response, "res/rtl/");
-    strcat(Topic_Response, LowerCaseMAC);
-    strcat(Topic_Response, "/setnodestartupinfo");
-    nodeInformation["ResponseTopic"] = Topic_Response;
-    generateCorrelationData();
-    nodeInformation["CorrelationData"] = CorrelationData;
-    nodeInformation["Payload"]["NodeId"] = MAC;
-    nodeInformation["Payload"]["Type"] = NodeType;
-    //nodeInformation["Payload"].createNestedArray("Channels");
+    char number[12];
+    if (!first)
+        strcat(payload, ",");
+    strcat(payload, "[");
+    intTochar((long)(sample.Time - firstTime), number);
+    strcat(payload, number);
+    strcat(payload, ",\"");
+    strcat(payload, sample.Value);
+    strcat(payload, "\"]");
+}
 
-    mqttClient.subscribe(Topic_Response);
-    mqttPublishJson("req/rtl/dataaccess/setnodestartupinfo");
-    nodeInformation.clear();
+void endSampleMessage(char* payload)
+{
+    strcat(payload, "]}");
+}
 
-    // Get response(s) from dataaccess
-    
-    unsigned long timeout = millis();
-    while(!ResponseReceived)
+size_t encodeSampleMessage(uint8_t* payload, size_t size, const RLSample* samples, int count, RLNodeBase& node)
+{
+    // Scale all values by the most decimals in the message, so every value is restored exactly as a number,
+    // 0 if a scaled value does not fit and the message must be published as text
+    int decimals = 0;
+    for (int i = 0; i < count; i++)
     {
-        mqttClient.loop();
-        // Timeout in case of lost messages
-        if (millis() - timeout > MAX_RES_TIME_OUT)
-        {
-            // TODO Send error message over MQTT?
-            mqttClient.unsubscribe(Topic_Response);
+        int sampleDecimals = RLBinaryEncoder::decimals(samples[i].Value);
+        if (sampleDecimals < 0)
             return 0;
-        }
+        if (sampleDecimals > decimals)
+            decimals = sampleDecimals;
     }
-    ResponseReceived = 0;
 
-    // TODO Handle processing message in other way?
-    // If processing message is received, listen for next message
-    if(!strncmp(jsonDoc["CmdStatus"], "Processing", 11))
+    RLBinaryEncoder encoder(payload, size);
+    unsigned long firstTime = samples[0].Time;
+    unsigned long seconds;
+    unsigned int milliseconds;
+    if (node.epochTime(firstTime, seconds, milliseconds))
+        encoder.begin(decimals, millis() - firstTime, seconds, milliseconds);
+    else
+        encoder.begin(decimals, millis() - firstTime);
+    for (int i = 0; i < count; i++)
     {
-        timeout = millis();
-        while(!ResponseReceived)
-        {
-            mqttClient.loop();
-            // Timeout in case of lost messages
-            if (millis() - timeout > MAX_RES_TIME_OUT)
-            {
-                // TODO Send error message over MQTT?
-                mqttClient.unsubscribe(Topic_Response);
-                return 0;
-            }
-        }
-        ResponseReceived = 0;
+        encoder.add(samples[i].Time, samples[i].Value);
     }
-    mqttClient.unsubscribe(Topic_Response);
+    return encoder.length();
+}
 
-    return 1;
+// ******************************************************************
+// Sample stores
+bool RLRamSampleStore::push(const RLStoredSample& sample)
+{
+    if (Count == SAMPLE_STORE_SIZE)
+        return false;
+    Samples[(Head + Count) % SAMPLE_STORE_SIZE] = sample;
+    Count++;
+    return true;
 }
 
-// Create and send request for channel configuration
-int RLNode::GetChannelConfig()
+bool RLRamSampleStore::read(unsigned int index, RLStoredSample& sample)
 {
-    int j = 0;
-    bool timeoutFlag;
-    while (j < ChannelCount)
-    {
-        // Send request to dataaccess for node configuration
-        strcpy(Topic_Response, "res/rtl/");
-        strcat(Topic_Response, LowerCaseMAC);
-        strcat(Topic_Response, "/getchannelconfiguration");
-        nodeInformation["ResponseTopic"] = Topic_Response;
-        generateCorrelationData();
-        nodeInformation["CorrelationData"] = CorrelationData;
-        nodeInformation["Payload"]["NodeId"] = MAC;
-        nodeInformation["Payload"]["ChannelId"] = (Channels[j])->ID;
+    if (index >= Count)
+        return false;
+    sample = Samples[(Head + index) % SAMPLE_STORE_SIZE];
+    return true;
+}
 
-        mqttClient.subscribe(Topic_Response);
-        mqttPublishJson("req/rtl/dataaccess/getchannelconfiguration");  // Local topic used to save memory
-        nodeInformation.clear();
+void RLRamSampleStore::remove(unsigned int count)
+{
+    if (count > Count)
+        count = Count;
+    Head = (Head + count) % SAMPLE_STORE_SIZE;
+    Count -= count;
+}
 
-        // Get response(s) from dataaccess
-        
-        timeoutFlag = false;
-        unsigned long timeout = millis();
-        while(!ResponseReceived)
-        {
-            mqttClient.loop();
-            // Timeout in case of lost messages
-            if (millis() - timeout > MAX_RES_TIME_OUT)
-            {
-                mqttClient.unsubscribe(Topic_Response);
-                timeoutFlag = true;
-                break;
-                //return 0;
-            }
-        }
-        if (timeoutFlag)
-        {
-            continue;
-        }
-        
-        ResponseReceived = 0;
+RLStorageSampleStore::RLStorageSampleStore(RLStorage& storage) : Storage(storage)
+{
+    Capacity = storage.size() / sizeof(RLStoredSample);
+}
 
-        // TODO Handle processing message in other way?
-        // If processing message is received, listen for next message
-        if(!strncmp(jsonDoc["CmdStatus"], "Processing", 11))
-        {
-            timeout = millis();
-            while(!ResponseReceived)
-            {
-                mqttClient.loop();
-                // Timeout in case of lost messages
-                if (millis() - timeout > MAX_RES_TIME_OUT)
-                {
-                    // TODO Send error message over MQTT?
-                    mqttClient.unsubscribe(Topic_Response);
-                    timeoutFlag = true;
-                    break;
-                    //return 0;
-                }
-            }
-            if (timeoutFlag)
-            {
-                continue;
-            }
-            
-            ResponseReceived = 0;
-        }
+bool RLStorageSampleStore::push(const RLStoredSample& sample)
+{
+    if (Count == Capacity)
+        return false;
+    if (!Storage.write(((Head + Count) % Capacity) * sizeof(RLStoredSample), &sample, sizeof(RLStoredSample)))
+        return false;
+    Count++;
+    return true;
+}
 
-        // Update channel configuration according to (first) response,
-        // as long as publishtopic isn't empty and the channel ID is valid
-        
-        int channelID = int(jsonDoc["Payload"]["ChannelId"]) - 1;
-        if (strlen(jsonDoc["Payload"]["Configuration"]["PublishTopic"]) > 0 &&
-                !jsonDoc["Payload"]["Configuration"]["PublishTopic"].isNull() &&
-                channelID < ChannelCount
-                && channelID >= 0)
-        {
-            // Update channel configuration using ID
-            (*Channels[channelID]).updateConfig();
-        }
+bool RLStorageSampleStore::read(unsigned int index, RLStoredSample& sample)
+{
+    if (index >= Count)
+        return false;
+    return Storage.read(((Head + index) % Capacity) * sizeof(RLStoredSample), &sample, sizeof(RLStoredSample));
+}
+
+void RLStorageSampleStore::remove(unsigned int count)
+{
+    if (count > Count)
+        count = Count;
+    Head = (Head + count) % Capacity;
+    Count -= count;
+}
 
-        j++;
+// ****************************************************************
+// RLNode class
+// Handles the node as a whole and contains a list of connected channels
+// The buffers are owned by RLNodeSized, which sets their sizes at compile time
+RLNodeBase::RLNodeBase(RLChannel** channels, RLExchange* exchanges, int channelCapacity,
+                       JsonDocument& jsonDoc, JsonDocument& nodeInformation, size_t jsonSize,
+                       char* topics, size_t topicLength, char* topicArena, size_t topicArenaSize,
+                       uint16_t* topicEntries, uint8_t topicEntryCount)
+    : TopicPool(topicArena, topicArenaSize, topicEntries, topicEntryCount), JsonDoc(jsonDoc), NodeInformation(nodeInformation)
+{
+    Session = &RLDefaultSession;
+    Channels = channels;
+    Exchanges = exchanges;
+    ChannelCapacity = channelCapacity;
+    JsonSize = jsonSize;
+    TopicLength = topicLength;
+    // Topic buffers, NODE_TOPIC_COUNT buffers of topicLength bytes
+    ResponseTopic = topics;
+    Topic_Scratch = topics + topicLength;
+    memset(RouteSlots, -1, sizeof(RouteSlots));
+    for (int i = 0; i < NODE_TOPIC_COUNT; i++)
+    {
+        topics[i * topicLength] = '\0';
     }
+}
 
-    
-    return 1;
+RLNodeBase::~RLNodeBase()
+{
+    Session->detach(this);
 }
-// Sends the properties of each channel to the dataaccess
-int RLNode::SetChannelProperties()
+
+void RLNodeBase::setSession(RLMqttSession& session)
 {
-    int i = 0;
-    bool timeoutFlag;
-    while (i<ChannelCount)
-    {
-        strcpy(Topic_Response, "res/rtl/");
-        strcat(Topic_Response, LowerCaseMAC);
-        strcat(Topic_Response, "/setchannelproperties");
-        nodeInformation["ResponseTopic"] = Topic_Response;
-        generateCorrelationData();
-        nodeInformation["CorrelationData"] = CorrelationData;
-        nodeInformation["Payload"]["NodeId"] = MAC;
-        Channels[i]->addChannelPropertiesByID();
-
-        mqttClient.subscribe(Topic_Response);
-        mqttPublishJson("req/rtl/dataaccess/setchannelproperties");  // Local topic used to save memory
-        nodeInformation.clear();
-
-        // Get response(s) from dataaccess
-        
-        timeoutFlag = false;
-        unsigned long timeout = millis();
-        while(!ResponseReceived)
+    Session->detach(this);
+    Session = &session;
+    SessionConnection = 0;
+}
+
+void RLNodeBase::begin(Client& client, const char* mac, const char* server, uint16_t port)
+{
+    begin(client, mac, server, port, NULL, NULL, "", "");
+}
+void RLNodeBase::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* nodename)
+{
+    begin(client, mac, server, port, NULL, NULL, nodename, "");
+}
+void RLNodeBase::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
+                   const char* password)
+{
+    begin(client, mac, server, port, username, password, "", "");
+}
+void RLNodeBase::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
+                   const char* password, const char* nodename)
+{
+    begin(client, mac, server, port, username, password, nodename, "");
+}
+void RLNodeBase::begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,
+                   const char* password, const char* nodename, const char* nodetype)
+{
+    randomSeed(millis()*micros());  // Used for generating correlationdata
+    
+    // Set Mac address, mqtt username, mqtt password, and nodename
+    // The overloads without credentials pass NULL, kept as "" and connected without credentials
+    if (username == NULL)
+        username = "";
+    if (password == NULL)
+        password = "";
+    strncpy(MAC, mac, strlen(mac) + 1);
+    strncpy(MQTTUsername, username, strlen(username) + 1);
+    strncpy(MQTTPassword, password, strlen(password) + 1);
+    strncpy(NodeName, nodename, strlen(nodename) + 1);
+    strncpy(NodeType, nodetype, strlen(nodetype) + 1);
+    
+    // Create lower case MAC address for use in topics
+    strncpy(LowerCaseMAC, MAC, strlen(MAC) + 1);
+    strLow(LowerCaseMAC);
+
+    Session->Mqtt.setClient(client);
+    // Set the MQTT server
+    Session->Mqtt.setServer(server, port);
+
+    // Join the session, set keepalive time, and set buffer size
+    // The buffer of a shared session is sized for the largest node
+    Session->attach(this);
+    Session->Mqtt.setKeepAlive(30);
+    if (Session->Mqtt.getBufferSize() >= JsonSize || Session->Mqtt.setBufferSize(JsonSize))
+    {
+        RL_LOG_INFO(F("  MQTT buffer size set to "), Session->Mqtt.getBufferSize());
+    }
+    else
+    {
+        RL_LOG_ERROR(F("[Error] Not enough memory for MQTT buffer"));
+        RLLog.drain();
+        while (true) { delay(1000); }
+    }
+
+    // Set topic names and subscribe to them (when connected, and again after every reconnect)
+    setSubscriptionTopicNames();
+    subscribe(Topic_IdentificationPoll);
+    subscribe(Topic_SetNodeConfig);
+    subscribe(Topic_SetChannelConfig);
+    subscribe(Topic_NodeConfigChanged);
+
+    // Start the channels from the configuration cache, so they sample before dataaccess has answered
+    // Done after the node topics are set, since the fixed topics are added to the topic pool first
+    if (ConfigCache != NULL)
+    {
+        for (int i = 0; i < ChannelCount; i++)
         {
-            mqttClient.loop();
-            // Timeout in case of lost messages
-            if (millis() - timeout > MAX_RES_TIME_OUT)
-            {
-                mqttClient.unsubscribe(Topic_Response);
-                timeoutFlag = true;
-                break;
-                //return 0;
-            }
+            loadChannelConfig(i);
         }
-        if (timeoutFlag)
+    }
+    RL_LOG_INFO(F("  Topic pool: "), TopicPool.used(), F(" of "), TopicPool.capacity(), F(" bytes used"));
+
+    // Attempt to connect to the server with mac address as ID, loop() retries if it fails
+    Time = millis();
+    RLNodeMqttReconnect(MAC);
+
+    // Publish an identification broadcast, channel properties, and fetch the channel configurations
+    // The requests are handled by loop(), StartupCallback is called when the configuration is done
+    sendNodeStartupInfo(NULL);
+    sendChannelProperties(NULL);
+    fetchChannelConfig(StartupCallback);
+    if (TimeSyncInterval > 0)
+        syncTime(NULL);
+}
+
+// Set the function called when the startup requests in begin() are completed
+void RLNodeBase::setStartupCallback(REQUEST_CALLBACK)
+{
+    StartupCallback = callback;
+}
+
+// Append list of channels with newChannel, returns false if the node has no room for more channels
+bool RLNodeBase::addChannel(RLChannel* newChannel)
+{
+    if (ChannelCount >= ChannelCapacity)
+    {
+        RL_LOG_ERROR(F("[Error] Channel limit reached, channel not added"));
+        return false;
+    }
+    Channels[ChannelCount] = newChannel;
+    (*newChannel).ID = ChannelCount+1;
+    (*newChannel).Node = this;
+    RL_LOG_INFO(F("  Added channel with ID: "), (*newChannel).ID);
+    ChannelCount++;
+    return true;
+}
+
+// Update loop: checks for MQTT messages and calls publishData for each channel that is due
+void RLNodeBase::loop()
+{
+    Looping = true;
+    unsigned long loopMicros = micros();
+    if (Diagnostics.Loops++ > 0)
+        Diagnostics.LoopPeriod.add(loopMicros - LastLoopMicros);
+    LastLoopMicros = loopMicros;
+
+    Time = millis();
+    // Reconnect to the mqtt broker in the case of a disconnect
+    RLNodeMqttReconnect(MAC);
+    // Check for incoming messages
+    Session->loop();
+    Time = millis();  // Time set here to enable multiple channels with same sample rate
+    schedulerTime();
+    pollRequests();
+    pollTimeSync();
+    updateCongestion();
+    drainStore();
+    drainAcquisition();
+    runScheduler();
+    for (int i = 0; i < ChannelCount; i++)
+    {
+        Channels[i]->flushBatch();
+    }
+    if (DiagnosticsInterval > 0 && Time - LastDiagnosticsTime >= DiagnosticsInterval && Session->Mqtt.connected())
+        publishDiagnostics();
+    if (TimeSyncInterval > 0 && Time - LastTimeSyncRequest >= TimeSyncInterval)
+        syncTime(NULL);
+    // Write the deferred log while no channel is due
+    if (timeUntilNextDeadline() > 0)
+        RLLog.drain();
+    Looping = false;
+}
+
+// Set the time in ms between diagnostics messages, 0 disables them
+void RLNodeBase::setDiagnosticsInterval(unsigned long interval)
+{
+    DiagnosticsInterval = interval;
+}
+
+// Set the time in ms between time sync requests, 0 disables them
+void RLNodeBase::setTimeSyncInterval(unsigned long interval)
+{
+    TimeSyncInterval = interval;
+}
+
+// Publish the performance counters since the latest message on the diagnostics topic and clear them,
+// one message for the node followed by one message per channel
+void RLNodeBase::publishDiagnostics()
+{
+    NodeInformation["Interval"] = Time - LastDiagnosticsTime;
+    NodeInformation["Loops"] = Diagnostics.Loops;
+    NodeInformation["PublishFailures"] = Diagnostics.PublishFailures;
+    NodeInformation["TimeSyncRoundTrip"] = TimeSyncRoundTrip;
+    NodeInformation["Reconnects"] = Diagnostics.Reconnects;
+    NodeInformation["StoredSamples"] = Store->count();
+    NodeInformation["DroppedSamples"] = StoreDropped;
+    NodeInformation["Congestion"] = Congestion;
+    NodeInformation["PublishLatency"] = PublishLatency;
+    NodeInformation["TopicPool"] = TopicPool.footprint();
+    JsonArray loopPeriod = NodeInformation.createNestedArray("LoopPeriod");
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        loopPeriod.add(Diagnostics.LoopPeriod.Counts[i]);
+    }
+    mqttPublishJson(Topic_Diagnostics);
+    NodeInformation.clear();
+    memset(&Diagnostics, 0, sizeof(Diagnostics));
+
+    for (int i = 0; i < ChannelCount; i++)
+    {
+        Channels[i]->addDiagnostics();
+        mqttPublishJson(Topic_Diagnostics);
+        NodeInformation.clear();
+    }
+    LastDiagnosticsTime = Time;
+}
+
+// Sample the channels that are due, earliest deadline first
+void RLNodeBase::runScheduler()
+{
+    // Nothing is due before the earliest deadline
+    if ((int64_t)(Clock - NextDeadline) < 0)
+        return;
+
+    // Each channel is serviced at most once per loop so a slow sensor can not starve the MQTT client
+    RLChannel* channel;
+    for (int serviced = 0; serviced < ChannelCount; serviced++)
+    {
+        channel = earliestChannel();
+        if (channel == NULL || (int64_t)(Clock - channel->NextDueTime) < 0)
+            break;
+        channel->publishData();
+    }
+
+    channel = earliestChannel();
+    if (channel == NULL)
+        NextDeadline = Clock + MICROS_TO_TICKS(SCHEDULER_IDLE_TIME * 1000ULL);
+    else
+        NextDeadline = channel->NextDueTime;
+}
+
+// Returns the active channel with the earliest deadline, NULL if no channel is active
+RLChannel* RLNodeBase::earliestChannel()
+{
+    RLChannel* earliest = NULL;
+    for (int i = 0; i < ChannelCount; i++)
+    {
+        if (!Channels[i]->isActive() || Channels[i]->usesAcquisition())
+            continue;
+        if (earliest == NULL || (int64_t)(Channels[i]->NextDueTime - earliest->NextDueTime) < 0)
+            earliest = Channels[i];
+    }
+    return earliest;
+}
+
+// Make the next loop re-evaluate all channel deadlines
+void RLNodeBase::rescheduleChannels()
+{
+    NextDeadline = schedulerTime();
+}
+
+// Time in ms until the next channel is due, 0 if a channel is already due
+// Returns SCHEDULER_IDLE_TIME or less when no channel is active
+unsigned long RLNodeBase::timeUntilNextDeadline()
+{
+    int64_t remaining = (int64_t)(NextDeadline - schedulerTime());
+    if (remaining <= 0)
+        return 0;
+    // Rounded up, so 0 is only returned when a channel is due
+    uint64_t ms = ((uint64_t)remaining + MICROS_TO_TICKS(1000) - 1) / MICROS_TO_TICKS(1000);
+    unsigned long next = ms < SCHEDULER_IDLE_TIME ? (unsigned long)ms : SCHEDULER_IDLE_TIME;
+    // Batches are published by loop() when they are old enough, also between the samples of their channel
+    for (int i = 0; i < ChannelCount && next > 0; i++)
+    {
+        unsigned long batch = Channels[i]->batchTimeLeft();
+        if (batch < next)
+            next = batch;
+    }
+    return next;
+}
+
+// Scheduler time with sub-microsecond resolution, see Clock
+// Called at least once per loop(), so micros() can not wrap more than once in between
+uint64_t RLNodeBase::schedulerTime()
+{
+    unsigned long now = micros();
+    Clock += MICROS_TO_TICKS(now - ClockMicros);
+    ClockMicros = now;
+    return Clock;
+}
+
+// Names of the dataaccess requests, indexed by request type
+// Requests are sent on req/rtl/dataaccess/<name> and answered on res/rtl/<mac>/<name>
+static const char* const RequestNames[] = {"setnodestartupinfo", "setchannelproperties", "getchannelconfiguration", "timesync"};
+
+// Queue a request to dataaccess, the request is sent and followed up by loop()
+// callback is called with 1 when all exchanges of the request succeeded, otherwise 0
+bool RLNodeBase::queueRequest(int type, REQUEST_CALLBACK)
+{
+    if (RequestCount >= MAX_QUEUED_REQUESTS)
+    {
+        RL_LOG_ERROR(F("[Error] Request queue is full"));
+        return false;
+    }
+    RLRequest& request = Requests[(RequestHead + RequestCount) % MAX_QUEUED_REQUESTS];
+    request.Type = type;
+    request.Next = 0;
+    request.Done = 0;
+    request.Failed = 0;
+    request.Blocking = false;
+    request.Callback = callback;
+    RequestCount++;
+    return true;
+}
+
+// Send startup information (node ID and type) to dataaccess
+bool RLNodeBase::sendNodeStartupInfo(REQUEST_CALLBACK)
+{
+    return queueRequest(REQUEST_NODE_STARTUP_INFO, callback);
+}
+
+// Send the properties of each channel to dataaccess
+bool RLNodeBase::sendChannelProperties(REQUEST_CALLBACK)
+{
+    return queueRequest(REQUEST_CHANNEL_PROPERTIES, callback);
+}
+
+// Fetch the configuration of each channel from dataaccess and apply it
+bool RLNodeBase::fetchChannelConfig(REQUEST_CALLBACK)
+{
+    return queueRequest(REQUEST_CHANNEL_CONFIG, callback);
+}
+
+// Request the epoch time from dataaccess, sent by loop() when connected
+// A time sync that is not answered is not retried, the next one is sent after TimeSyncInterval
+bool RLNodeBase::syncTime(REQUEST_CALLBACK)
+{
+    LastTimeSyncRequest = millis();
+    if (TimeSync.State != EXCHANGE_IDLE)
+        return false;
+    TimeSyncCallback = callback;
+    TimeSync.State = EXCHANGE_RETRY;
+    TimeSync.Attempts = 0;
+    return true;
+}
+
+// True while requests are queued or waiting for a response, time syncs are not included
+bool RLNodeBase::requestsPending()
+{
+    return RequestCount > 0;
+}
+
+// Send all exchanges of a request back to back instead of waiting for each response
+void RLNodeBase::setPipelinedRequests(bool pipelined)
+{
+    PipelinedRequests = pipelined;
+}
+
+// Set the time in ms to wait for a response, and the delay before a request that timed out is sent again
+// Defaults to MAX_RES_TIME_OUT and REQUEST_RETRY_DELAY
+void RLNodeBase::setRequestTimeouts(unsigned long responseTimeout, unsigned long retryDelay)
+{
+    ResponseTimeout = responseTimeout;
+    RetryDelay = retryDelay;
+}
+
+// Queue a request and run the update loop until it is completed, 0 if it is not completed in time
+// Like the first versions of the blocking requests, a response and a response after "Processing" are waited for
+int RLNodeBase::runBlockingRequest(int type)
+{
+    if (Looping)
+    {
+        RL_LOG_ERROR(F("[Error] Blocking request called from loop(), use the callback version"));
+        return 0;
+    }
+    BlockingRequestResult = -1;
+    if (!queueRequest(type, NULL))
+        return 0;
+    Requests[(RequestHead + RequestCount - 1) % MAX_QUEUED_REQUESTS].Blocking = true;
+    unsigned long start = millis();
+    while (BlockingRequestResult < 0)
+    {
+        if (millis() - start >= 2 * ResponseTimeout)
         {
+            RL_LOG_WARN(F("[Warning] No response on "), RequestNames[type]);
+            cancelBlockingRequest();
+            return 0;
+        }
+        loop();
+    }
+    return BlockingRequestResult;
+}
+
+// Remove the blocking request from the queue, its exchanges are abandoned if it is being sent
+void RLNodeBase::cancelBlockingRequest()
+{
+    for (int i = 0; i < RequestCount; i++)
+    {
+        RLRequest& request = Requests[(RequestHead + i) % MAX_QUEUED_REQUESTS];
+        if (!request.Blocking)
             continue;
+        if (i == 0)
+        {
+            for (int j = 0; j < ChannelCapacity; j++)
+                Exchanges[j].State = EXCHANGE_IDLE;
+            buildTopic(Topic_Scratch, Topic_Response, RequestNames[request.Type]);
+            Session->Mqtt.unsubscribe(Topic_Scratch);
+            ResponseSubscribed = false;
+            RequestHead = (RequestHead + 1) % MAX_QUEUED_REQUESTS;
         }
-        
-        ResponseReceived = 0;
+        else
+        {
+            // Later requests move up one place
+            for (int j = i; j < RequestCount - 1; j++)
+                Requests[(RequestHead + j) % MAX_QUEUED_REQUESTS] = Requests[(RequestHead + j + 1) % MAX_QUEUED_REQUESTS];
+        }
+        RequestCount--;
+        return;
+    }
+}
+
+// Create and send startup information, blocks until dataaccess has answered
+int RLNodeBase::SetNodeStartupInfo()
+{
+    return runBlockingRequest(REQUEST_NODE_STARTUP_INFO);
+}
+
+// Create and send request for channel configuration, blocks until all channels are configured
+int RLNodeBase::GetChannelConfig()
+{
+    return runBlockingRequest(REQUEST_CHANNEL_CONFIG);
+}
+
+// Sends the properties of each channel to the dataaccess, blocks until dataaccess has answered
+int RLNodeBase::SetChannelProperties()
+{
+    return runBlockingRequest(REQUEST_CHANNEL_PROPERTIES);
+}
+
+// Request/response state machine, called every loop cycle
+// Sends the exchanges of the first queued request and handles timeouts and retries
+// In pipelined mode all exchanges of a request are sent back to back, otherwise one at a time
+void RLNodeBase::pollRequests()
+{
+    if (RequestCount == 0 || !Session->Mqtt.connected())
+        return;
+
+    RLRequest& request = Requests[RequestHead];
+    // Node startup information is a single exchange, channel requests are one exchange per channel
+    int exchangeCount = request.Type == REQUEST_NODE_STARTUP_INFO ? 1 : ChannelCount;
+    int window = PipelinedRequests ? ChannelCapacity : 1;
+    int inFlight = 0;
 
-        // TODO Handle processing message in other way?
-        // If processing message is received, listen for next message
-        if(!strncmp(jsonDoc["CmdStatus"], "Processing", 11))
+    for (int i = 0; i < ChannelCapacity; i++)
+    {
+        RLExchange& exchange = Exchanges[i];
+        switch (exchange.State)
         {
-            timeout = millis();
-            while(!ResponseReceived)
+        case EXCHANGE_WAITING:
+        case EXCHANGE_PROCESSING:
+            // Timeout in case of lost messages
+            if ((long)(Time - exchange.Deadline) >= 0)
             {
-                mqttClient.loop();
-                // Timeout in case of lost messages
-                if (millis() - timeout > MAX_RES_TIME_OUT)
+                RL_LOG_WARN(F("[Warning] No response on "), RequestNames[request.Type]);
+                exchange.Attempts++;
+                if (MAX_REQUEST_ATTEMPTS > 0 && exchange.Attempts >= MAX_REQUEST_ATTEMPTS)
                 {
-                    // TODO Send error message over MQTT?
-                    mqttClient.unsubscribe(Topic_Response);
-                    timeoutFlag = true;
-                    break;
-                    //return 0;
+                    request.Failed++;
+                    request.Done++;
+                    exchange.State = EXCHANGE_IDLE;
+                    continue;
                 }
+                exchange.State = EXCHANGE_RETRY;
+                exchange.Deadline = Time + RetryDelay;
             }
-            if (timeoutFlag)
-            {
-                continue;
-            }
-            
-            ResponseReceived = 0;
+            break;
+
+        case EXCHANGE_RETRY:
+            if ((long)(Time - exchange.Deadline) >= 0)
+                sendExchange(exchange, request.Type);
+            break;
+
+        default:
+            continue;
         }
-        mqttClient.unsubscribe(Topic_Response);
-        i++;
+        inFlight++;
     }
 
-    return 1;
+    // Fill free slots with the next exchanges of the request
+    for (int i = 0; i < ChannelCapacity && inFlight < window && request.Next < exchangeCount; i++)
+    {
+        if (Exchanges[i].State != EXCHANGE_IDLE)
+            continue;
+        Exchanges[i].Index = request.Next++;
+        Exchanges[i].Attempts = 0;
+        sendExchange(Exchanges[i], request.Type);
+        inFlight++;
+    }
+
+    if (request.Done >= exchangeCount)
+        completeRequest();
+}
+
+// Build and publish one exchange of a request, exchange.Index is the channel index for channel requests
+void RLNodeBase::sendExchange(RLExchange& exchange, int type)
+{
+    char* topic = Topic_Scratch;
+
+    buildTopic(topic, Topic_Response, RequestNames[type]);
+    NodeInformation["ResponseTopic"] = topic;
+    // Subscribed once per request, and again on retries in case the connection was lost
+    // Time sync is not queued and subscribes to its own response topic every time
+    if (type == REQUEST_TIME_SYNC)
+        Session->Mqtt.subscribe(topic);
+    else if (exchange.Attempts > 0 || !ResponseSubscribed)
+        ResponseSubscribed = Session->Mqtt.subscribe(topic);
+
+    generateCorrelationData();
+    strcpy(exchange.CorrelationData, CorrelationData);
+    NodeInformation["CorrelationData"] = CorrelationData;
+    NodeInformation["Payload"]["NodeId"] = MAC;
+    if (type == REQUEST_NODE_STARTUP_INFO)
+        NodeInformation["Payload"]["Type"] = NodeType;
+    else if (type == REQUEST_CHANNEL_PROPERTIES)
+        Channels[exchange.Index]->addChannelPropertiesByID();
+    else if (type == REQUEST_CHANNEL_CONFIG)
+        NodeInformation["Payload"]["ChannelId"] = Channels[exchange.Index]->ID;
+    // Time sync requests only carry the node ID, the node keeps the send time
+
+    buildTopic(topic, "req/rtl/dataaccess/", RequestNames[type]);
+    mqttPublishJson(topic);
+    NodeInformation.clear();
+
+    exchange.State = EXCHANGE_WAITING;
+    exchange.SentTime = millis();
+    exchange.Deadline = exchange.SentTime + ResponseTimeout;
+}
+
+// Returns the pending exchange the response in JsonDoc belongs to, NULL if there is none
+// Responses are matched by CorrelationData, so they may arrive in any order
+RLExchange* RLNodeBase::findExchange()
+{
+    RLExchange* waiting = NULL;
+    int waitingCount = 0;
+    for (int i = 0; i < ChannelCapacity; i++)
+    {
+        RLExchange& exchange = Exchanges[i];
+        if (exchange.State != EXCHANGE_WAITING && exchange.State != EXCHANGE_PROCESSING)
+            continue;
+        if (JsonDoc["CorrelationData"].is<const char*>() &&
+            !strcmp(JsonDoc["CorrelationData"], exchange.CorrelationData))
+            return &exchange;
+        waiting = &exchange;
+        waitingCount++;
+    }
+    // Responses without CorrelationData can only be matched when a single exchange is in flight
+    if (JsonDoc["CorrelationData"].isNull() && waitingCount == 1)
+        return waiting;
+    return NULL;
+}
+
+// Handle a message on one of the response topics, the message is stored in JsonDoc
+void RLNodeBase::handleResponse(char* topic)
+{
+    // Time sync is not queued, its response is matched by topic and CorrelationData
+    if (!strcmp(topic + strlen(Topic_Response), RequestNames[REQUEST_TIME_SYNC]))
+    {
+        if (TimeSync.State != EXCHANGE_WAITING)
+            return;  // Late response to a time sync that has timed out
+        if (JsonDoc["CorrelationData"].is<const char*>() && strcmp(JsonDoc["CorrelationData"], TimeSync.CorrelationData))
+            return;
+        // A processing message only adds to the round trip, the time sync still ends at its deadline
+        if (JsonDoc["CmdStatus"].is<const char*>() && !strcmp(JsonDoc["CmdStatus"], "Processing"))
+            return;
+        completeTimeSync(updateTimeSync(TimeSync));
+        return;
+    }
+    if (RequestCount == 0)
+        return;
+
+    RLRequest& request = Requests[RequestHead];
+    if (strcmp(topic + strlen(Topic_Response), RequestNames[request.Type]))
+        return;  // Late response to an earlier request
+    RLExchange* exchange = findExchange();
+    if (exchange == NULL)
+        return;  // Late response to an exchange that has been resent
+
+    // If processing message is received, listen for next message
+    if (JsonDoc["CmdStatus"].is<const char*>() && !strcmp(JsonDoc["CmdStatus"], "Processing"))
+    {
+        exchange->State = EXCHANGE_PROCESSING;
+        exchange->Deadline = millis() + ResponseTimeout;
+        return;
+    }
+
+    if (request.Type == REQUEST_CHANNEL_CONFIG)
+    {
+        // Update channel configuration according to (first) response, if the channel ID is valid
+        // A channel without publishtopic is not configured in dataaccess, also when it was started from the cache
+        int channelID = int(JsonDoc["Payload"]["ChannelId"]) - 1;
+        if (channelID < ChannelCount && channelID >= 0)
+        {
+            if (strlen(JsonDoc["Payload"]["Configuration"]["PublishTopic"] | "") > 0)
+                applyChannelConfig(channelID);
+            else
+                removeChannelConfig(channelID);
+        }
+    }
+
+    request.Done++;
+    exchange->State = EXCHANGE_IDLE;
+}
+
+// Send a time sync that is waiting for the connection, and give up on one that is not answered in time
+// The response is only used within TIME_SYNC_MAX_ROUND_TRIP, so there is no point in waiting longer
+void RLNodeBase::pollTimeSync()
+{
+    if (TimeSync.State == EXCHANGE_RETRY)
+    {
+        if (Session->Mqtt.connected())
+        {
+            TimeSync.Attempts++;
+            sendExchange(TimeSync, REQUEST_TIME_SYNC);
+        }
+    }
+    else if (TimeSync.State == EXCHANGE_WAITING && Time - TimeSync.SentTime >= TIME_SYNC_MAX_ROUND_TRIP)
+    {
+        RL_LOG_WARN(F("[Warning] No response on "), RequestNames[REQUEST_TIME_SYNC]);
+        completeTimeSync(0);
+    }
+}
+
+// Unsubscribe from the time sync response and report the result, 1 if the clock was updated
+void RLNodeBase::completeTimeSync(int result)
+{
+    REQUEST_CALLBACK = TimeSyncCallback;
+    buildTopic(Topic_Scratch, Topic_Response, RequestNames[REQUEST_TIME_SYNC]);
+    Session->Mqtt.unsubscribe(Topic_Scratch);
+    TimeSync.State = EXCHANGE_IDLE;
+    TimeSyncCallback = NULL;
+    // Called last, the callback may start a new time sync
+    if (callback != NULL)
+        callback(result);
+}
+
+// Update the epoch time from a time sync response,
+// {"Payload":{"Seconds":s,"Milliseconds":ms}} with the time dataaccess handled the request
+// The response is assumed to be sent halfway through the round trip, as in NTP
+bool RLNodeBase::updateTimeSync(RLExchange& exchange)
+{
+    if (!JsonDoc["Payload"]["Seconds"].is<unsigned long>())
+    {
+        RL_LOG_WARN(F("[Warning] Time sync response without time"));
+        return false;
+    }
+    unsigned long now = millis();
+    unsigned long roundTrip = now - exchange.SentTime;
+    if (roundTrip > TIME_SYNC_MAX_ROUND_TRIP)
+    {
+        RL_LOG_WARN(F("[Warning] Time sync round trip too long: "), roundTrip, F(" ms"));
+        return false;
+    }
+    unsigned long localTime = exchange.SentTime + roundTrip / 2;
+    unsigned long seconds = JsonDoc["Payload"]["Seconds"];
+    unsigned int milliseconds = JsonDoc["Payload"]["Milliseconds"] | 0;
+
+    // The error of the previous estimate gives the drift of the local clock,
+    // averaged with the previous drift to smooth out the round trip jitter
+    unsigned long predictedSeconds;
+    unsigned int predictedMilliseconds;
+    if (epochTime(localTime, predictedSeconds, predictedMilliseconds) && localTime - SyncTime >= TIME_SYNC_MIN_DRIFT_INTERVAL)
+    {
+        long error = (long)(seconds - predictedSeconds) * 1000 + ((long)milliseconds - (long)predictedMilliseconds);
+        Drift += (int32_t)((((int64_t)error) << 32) / (int64_t)(localTime - SyncTime) / 2);
+    }
+    SyncTime = localTime;
+    SyncSeconds = seconds;
+    SyncMilliseconds = milliseconds;
+    TimeSynced = true;
+    TimeSyncRoundTrip = roundTrip;
+    RL_LOG_DEBUG(F("  Time synced, round trip "), roundTrip, F(" ms"));
+    return true;
+}
+
+bool RLNodeBase::epochTime(unsigned long localTime, unsigned long& seconds, unsigned int& milliseconds)
+{
+    if (!TimeSynced)
+        return false;
+    // Samples are never newer than now, so comparing the ages tells whether localTime is before the sync,
+    // the deltas are unsigned so they do not overflow after 24.8 days like a signed difference would
+    unsigned long now = millis();
+    if (now - localTime <= now - SyncTime)
+    {
+        unsigned long elapsed = localTime - SyncTime;
+        unsigned long correction = (unsigned long)((elapsed * (int64_t)Drift) >> 32);
+        unsigned long total = elapsed + correction;
+        seconds = SyncSeconds + total / 1000 + (total % 1000 + SyncMilliseconds) / 1000;
+        milliseconds = (total % 1000 + SyncMilliseconds) % 1000;
+    }
+    else
+    {
+        // Read before the sync, e.g. a sample batched or stored before the first time sync
+        unsigned long before = SyncTime - localTime;
+        before += (unsigned long)((before * (int64_t)Drift) >> 32);
+        unsigned long rest = before % 1000;
+        seconds = SyncSeconds - before / 1000;
+        if (rest > SyncMilliseconds)
+        {
+            seconds--;
+            milliseconds = SyncMilliseconds + 1000 - rest;
+        }
+        else
+            milliseconds = SyncMilliseconds - rest;
+    }
+    return true;
+}
+
+bool RLNodeBase::formatEpochTime(unsigned long localTime, char* output)
+{
+    unsigned long seconds;
+    unsigned int milliseconds;
+    if (!epochTime(localTime, seconds, milliseconds))
+        return false;
+    intTochar((long)seconds, output);
+    output += strlen(output);
+    output[0] = '.';
+    output[1] = '0' + milliseconds / 100;
+    output[2] = '0' + milliseconds / 10 % 10;
+    output[3] = '0' + milliseconds % 10;
+    output[4] = '\0';
+    return true;
+}
+
+// Remove the finished request from the queue and report the result
+void RLNodeBase::completeRequest()
+{
+    RLRequest& request = Requests[RequestHead];
+    REQUEST_CALLBACK = request.Callback;
+    int result = request.Failed == 0;
+    if (request.Blocking)
+        BlockingRequestResult = result;
+
+    buildTopic(Topic_Scratch, Topic_Response, RequestNames[request.Type]);
+    Session->Mqtt.unsubscribe(Topic_Scratch);
+    ResponseSubscribed = false;
+
+    if (request.Type == REQUEST_CHANNEL_CONFIG)
+    {
+        // New configurations, every channel should publish its next value
+        for (int i = 0; i < ChannelCount; i++)
+        {
+            strcpy(Channels[i]->PreviousOutputString, "");
+        }
+        RL_LOG_INFO(F("  Channel configuration completed"));
+    }
+    else if (request.Type == REQUEST_CHANNEL_PROPERTIES)
+        RL_LOG_INFO(F("  Set Channel Properties completed"));
+    else if (request.Type == REQUEST_NODE_STARTUP_INFO)
+        RL_LOG_INFO(F("  Startup information sent"));
+
+    RequestHead = (RequestHead + 1) % MAX_QUEUED_REQUESTS;
+    RequestCount--;
+    // Called last, the callback may queue new requests
+    if (callback != NULL)
+        callback(result);
+}
+
+// Fields of incoming messages that are used, for each type of message
+static void buildFilter(JsonDocument& filter, uint8_t handler)
+{
+    filter["CorrelationData"] = true;
+    switch (handler)
+    {
+    case ROUTE_IDENTIFICATION_POLL:
+        filter["ResponseTopic"] = true;
+        break;
+    case ROUTE_SET_NODE_CONFIG:
+        filter["ResponseTopic"] = true;
+        filter["Payload"]["NodeName"] = true;
+        break;
+    case ROUTE_SET_CHANNEL_CONFIG:
+        filter["ResponseTopic"] = true;
+        filter["Payload"]["ChannelId"] = true;
+        filter["Payload"]["Configuration"] = true;
+        break;
+    case ROUTE_RESPONSE:
+        filter["CmdStatus"] = true;
+        filter["Payload"]["ChannelId"] = true;
+        filter["Payload"]["Configuration"] = true;
+        filter["Payload"]["Seconds"] = true;
+        filter["Payload"]["Milliseconds"] = true;
+        break;
+    }
 }
 
 // Internal callback function for incoming MQTT topics, reroutes to the right function
-void RLNode::mqttCallback(char* topic, char* payload)
+void RLNodeBase::mqttCallback(char* topic, byte* payload, unsigned int length)
 {
-    // Save input message to jsonDoc variable
-    deserializeJson(jsonDoc, payload);
+    RLTopicRoute* route = findRoute(topic);
+    if (route != NULL && route->Handler == ROUTE_USER)
+    {
+        route->Callback(topic, payload, length);
+        return;
+    }
+    // Responses to requests are not in the table, they share the Topic_Response prefix
+    if (route == NULL && (ResponsePrefixLength == 0 || strncmp(topic, Topic_Response, ResponsePrefixLength)))
+    {
+        RL_LOG_WARN(F("No function set for topic ("), topic, F(")."));
+        return;
+    }
 
-    // Check topic and select the respective function
-    if (!strncmp(topic, Topic_IdentificationPoll, strlen(Topic_IdentificationPoll) + 1))
-        responseIdentificationPoll();
-    else if (!strncmp(topic, Topic_NodeConfigChanged, strlen(Topic_NodeConfigChanged) + 1))
+    // Configuration notifications have no fields that are used
+    if (route != NULL && route->Handler == ROUTE_NODE_CONFIG_CHANGED)
+    {
         nodeConfigChanged();
-    else if (!strncmp(topic, Topic_Response, strlen(Topic_Response)) + 1)
-        ResponseReceived = true;
-    else
-        Serial.println(F("No function set for this topic."));  // Should not be possible
+        return;
+    }
+
+    // Parse in place and keep only the fields used by the handler,
+    // handlers must be done with JsonDoc before they publish since publishing overwrites the MQTT buffer
+    uint8_t handler = route != NULL ? route->Handler : ROUTE_RESPONSE;
+    StaticJsonDocument<JSON_FILTER_SIZE> filter;
+    buildFilter(filter, handler);
+    if (deserializeJson(JsonDoc, (char*)payload, length, DeserializationOption::Filter(filter)))
+    {
+        RL_LOG_WARN(F("Invalid JSON on ("), topic, F(")."));
+        JsonDoc.clear();
+        return;
+    }
+    switch (handler)
+    {
+    case ROUTE_IDENTIFICATION_POLL:
+        responseIdentificationPoll();
+        break;
+    case ROUTE_SET_NODE_CONFIG:
+        responseSetNodeConfig();
+        break;
+    case ROUTE_SET_CHANNEL_CONFIG:
+        responseSetChannelConfig();
+        break;
+    case ROUTE_RESPONSE:
+        handleResponse(topic);
+        break;
+    }
+    JsonDoc.clear();  // The strings are not valid after the next publish
+}
+
+// FNV-1a hash of topic folded to 16 bits, length is set to the length of topic
+static uint16_t topicHash(const char* topic, uint16_t& length)
+{
+    uint32_t hash = 2166136261UL;
+    length = 0;
+    while (topic[length] != '\0')
+    {
+        hash = (hash ^ (uint8_t)topic[length]) * 16777619UL;
+        length++;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
 }
 
-// Publish payload to topic
-void RLNode::mqttPublishData(char* topic, char* payload) 
+bool RLNodeBase::handlesTopic(const char* topic)
+{
+    return findRoute(topic) != NULL ||
+           (ResponsePrefixLength > 0 && !strncmp(topic, Topic_Response, ResponsePrefixLength));
+}
+
+RLTopicRoute* RLNodeBase::findRoute(const char* topic)
+{
+    uint16_t length;
+    uint16_t hash = topicHash(topic, length);
+    // Linear probing, the table is never full so an empty slot ends the search
+    for (int i = 0; i < TOPIC_ROUTE_SLOTS; i++)
+    {
+        int8_t index = RouteSlots[(hash + i) & (TOPIC_ROUTE_SLOTS - 1)];
+        if (index < 0)
+            return NULL;
+        RLTopicRoute& route = Routes[index];
+        if (route.Hash == hash && route.Length == length && !memcmp(route.Topic, topic, length))
+            return &route;
+    }
+    return NULL;
+}
+
+bool RLNodeBase::addRoute(const char* topic, uint8_t handler, TOPIC_HANDLER)
+{
+    RLTopicRoute* route = findRoute(topic);
+    if (route == NULL)
+    {
+        if (RouteCount >= MAX_TOPIC_ROUTES)
+        {
+            RL_LOG_ERROR(F("[Error] Too many topic routes"));
+            return false;
+        }
+        route = &Routes[RouteCount];
+        route->Topic = topic;
+        route->Hash = topicHash(topic, route->Length);
+        int slot = route->Hash & (TOPIC_ROUTE_SLOTS - 1);
+        while (RouteSlots[slot] >= 0)
+            slot = (slot + 1) & (TOPIC_ROUTE_SLOTS - 1);
+        RouteSlots[slot] = RouteCount++;
+    }
+    route->Handler = handler;
+    route->Callback = topicHandler;
+    return true;
+}
+
+bool RLNodeBase::registerTopicHandler(const char* topic, TOPIC_HANDLER)
+{
+    if (topicHandler == NULL || !addRoute(topic, ROUTE_USER, topicHandler))
+        return false;
+    return subscribe(topic);
+}
+
+bool RLNodeBase::mqttPublishData(const char* topic, const char* payload)
 {
     // Attempt to publish a value to the response topic
-    Serial.print(F("Attempting to publish data: "));
-    Serial.print(payload);
-    Serial.print(F(" on topic: "));
-    Serial.println(topic);
+    RL_LOG_DEBUG(F("Attempting to publish data: "), payload, F(" on topic: "), topic);
 
-    if (!mqttClient.publish(topic,payload))
+    unsigned long start = micros();
+    bool published = Session->Mqtt.publish(topic, payload);
+    recordPublish(published, micros() - start);
+    if (!published)
     {
-        Serial.println(F("[Error] Failed to send."));
-        delay(500);
+        Diagnostics.PublishFailures++;
+        return false;
     }
+    return true;
 }
 
-// Publish json to topic
-void RLNode::mqttPublishJson(char* topic)
+bool RLNodeBase::mqttPublishData(const char* topic, const uint8_t* payload, unsigned int length)
+{
+    RL_LOG_DEBUG(F("Attempting to publish "), length, F(" bytes on topic: "), topic);
+
+    unsigned long start = micros();
+    bool published = Session->Mqtt.publish(topic, payload, length);
+    recordPublish(published, micros() - start);
+    if (!published)
+    {
+        Diagnostics.PublishFailures++;
+        return false;
+    }
+    return true;
+}
+
+// ******************************************************************
+// Rate control
+// The uplink is congested when publishes fail, take longer than CONGESTION_MAX_LATENCY,
+// or the sample store fills up, and the node responds one stage at a time (see CONGESTION_*)
+void RLNodeBase::recordPublish(bool published, unsigned long latency)
+{
+    // During an outage every sample fails, so the failure is logged once and the count when sending resumes
+    if (!published && FailedSends++ == 0)
+        RL_LOG_ERROR(F("[Error] Failed to send."));
+    else if (published && FailedSends > 0)
+    {
+        RL_LOG_INFO(F("Sending resumed after "), FailedSends, F(" failed publishes"));
+        FailedSends = 0;
+    }
+    // Publishes fail at once while the broker cannot be reached, that says nothing about the uplink
+    if (!Session->Mqtt.connected())
+        return;
+    IntervalPublishes++;
+    IntervalLatency += latency;
+    if (!published)
+        IntervalFailures++;
+}
+
+void RLNodeBase::updateCongestion()
+{
+    if (Time - CongestionTime < CONGESTION_INTERVAL)
+        return;
+    CongestionTime = Time;
+    // The stage is not changed during an outage, the samples go to the sample store until onConnected()
+    if (!Session->Mqtt.connected())
+    {
+        IntervalPublishes = 0;
+        IntervalFailures = 0;
+        IntervalLatency = 0;
+        return;
+    }
+    PublishLatency = IntervalPublishes > 0 ? IntervalLatency / IntervalPublishes : 0;
+    bool congested = IntervalFailures > 0 || PublishLatency > CONGESTION_MAX_LATENCY ||
+                     Store->count() * 100 > Store->capacity() * CONGESTION_STORE_FILL;
+    IntervalPublishes = 0;
+    IntervalFailures = 0;
+    IntervalLatency = 0;
+
+    uint8_t congestion = Congestion;
+    if (congested)
+    {
+        CongestionClear = 0;
+        if (congestion < CONGESTION_DROP)
+            congestion++;
+    }
+    else if (congestion > CONGESTION_NONE && ++CongestionClear >= CONGESTION_RECOVERY)
+    {
+        CongestionClear = 0;
+        congestion--;
+    }
+    if (congestion == Congestion)
+        return;
+
+    Congestion = congestion;
+    MaxPriority = 0;
+    bool first = true;
+    for (int i = 0; i < ChannelCount; i++)
+    {
+        if (Channels[i]->isActive() && (first || Channels[i]->getPriority() > MaxPriority))
+        {
+            MaxPriority = Channels[i]->getPriority();
+            first = false;
+        }
+    }
+    RL_LOG_WARN(F("Congestion stage "), (int)Congestion, F(", publish time "), PublishLatency, F(" us"));
+    publishRateControl();
+}
+
+// Report the congestion stage and the effective rate of every channel on not/<MAC>/diagnostics,
+// {"Congestion":stage,"PublishLatency":us,"StoredSamples":n,"Channels":[{"ChannelId":id,"EffectiveRate":rate},...]}
+// Channels that do not fit in the JSON document of the node are reported in more messages of the same format
+void RLNodeBase::publishRateControl()
+{
+    if (!Session->Mqtt.connected())
+        return;
+    int i = 0;
+    do
+    {
+        NodeInformation.clear();
+        NodeInformation["Congestion"] = Congestion;
+        NodeInformation["PublishLatency"] = PublishLatency;
+        NodeInformation["StoredSamples"] = Store->count();
+        JsonArray channels = NodeInformation.createNestedArray("Channels");
+        int first = i;
+        for (; i < ChannelCount; i++)
+        {
+            JsonObject channel = channels.createNestedObject();
+            channel["ChannelId"] = Channels[i]->ID;
+            channel["EffectiveRate"] = Channels[i]->effectiveRate();
+            if (NodeInformation.overflowed())
+            {
+                channels.remove(channels.size() - 1);
+                break;
+            }
+        }
+        // Not even one channel fits, the message is not sent
+        if (i == first && ChannelCount > 0)
+        {
+            RL_LOG_ERROR(F("[Error] JSON document too small for the rate control message"));
+            break;
+        }
+        mqttPublishJson(Topic_Diagnostics);
+    } while (i < ChannelCount);
+    NodeInformation.clear();
+}
+
+bool RLNodeBase::publishSamples(RLChannel& channel, const RLSample* samples, int count)
 {
+    if (channel.getEncoding() == ENCODING_BINARY)
+    {
+        uint8_t payload[MAX_BINARY_PAYLOAD_SIZE];
+        size_t length = encodeSampleMessage(payload, sizeof(payload), samples, count, *this);
+        // Values that are not decimal numbers are published as text
+        if (length > 0)
+            return mqttPublishData(channel.getPublishTopic(), payload, length);
+    }
+
+    char payload[MAX_BATCH_PAYLOAD_SIZE];
+    beginSampleMessage(payload, samples[0].Time, *this);
+    for (int i = 0; i < count; i++)
+    {
+        appendSampleMessage(payload, samples[i], samples[0].Time, i == 0);
+    }
+    endSampleMessage(payload);
+    return mqttPublishData(channel.getPublishTopic(), payload);
+}
+
+// Keep a sample that could not be published, the oldest sample is dropped if the store is full
+void RLNodeBase::storeSample(int channel, const RLSample& sample)
+{
+    RLStoredSample stored;
+    stored.Channel = channel;
+    stored.Sample = sample;
+    if (!Store->push(stored))
+    {
+        Store->remove(1);
+        StoreDropped++;
+        Store->push(stored);
+    }
+}
+
+// Replace the default RAM sample store, e.g. with a RLStorageSampleStore
+void RLNodeBase::setSampleStore(RLSampleStore* store)
+{
+    Store = store;
+}
+
+// ******************************************************************
+// Configuration cache
+#define CONFIG_CACHE_MAGIC 0x52434C52UL  // "RLCR"
+#define CONFIG_CACHE_PREFIX "{\"Payload\":{\"Configuration\":"
+
+// FNV-1a hash of a configuration, never 0 so 0 can mean no configuration
+static uint32_t configHash(const char* config, size_t length)
+{
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (uint8_t)config[i]) * 16777619UL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+void RLNodeBase::setConfigCache(RLStorage* storage)
+{
+    ConfigCache = storage;
+}
+
+// Apply the configuration in JsonDoc to a channel and keep it in the configuration cache
+// A channel started from the cache keeps running, without a new activation delay, if the configuration is the same
+void RLNodeBase::applyChannelConfig(int index)
+{
+    RLChannel& channel = *Channels[index];
+    char config[CONFIG_CACHE_SLOT_SIZE];
+    size_t length = measureJson(JsonDoc["Payload"]["Configuration"]);
+    bool fits = length < sizeof(config);
+    if (fits)
+        serializeJson(JsonDoc["Payload"]["Configuration"], config, sizeof(config));
+    uint32_t hash = fits ? configHash(config, length) : 0;
+    bool confirmed = channel.ConfigFromCache && hash == channel.ConfigHash;
+    channel.ConfigFromCache = false;
+    channel.ConfigHash = hash;
+    if (confirmed)
+    {
+        RL_LOG_INFO(F("  Channel "), channel.ID, F(" cached configuration confirmed"));
+        return;
+    }
+
+    channel.updateConfig();
+    if (ConfigCache == NULL)
+        return;
+    if (!fits || length > CONFIG_CACHE_SLOT_SIZE - sizeof(RLConfigCacheRecord))
+        RL_LOG_WARN(F("[Warning] Configuration of channel "), channel.ID, F(" too large for the configuration cache"));
+    else if (!saveChannelConfig(index, config, length, hash))
+        RL_LOG_WARN(F("[Warning] Configuration of channel "), channel.ID, F(" could not be cached"));
+}
+
+// Stop a channel that has no configuration in dataaccess and clear its slot in the configuration cache,
+// so a configuration that was removed in dataaccess is not started from the cache on the next boot
+void RLNodeBase::removeChannelConfig(int index)
+{
+    RLChannel& channel = *Channels[index];
+    channel.ConfigFromCache = false;
+    channel.ConfigHash = 0;
+    channel.updateConfig();  // No PublishTopic, the channel goes idle
+    RL_LOG_INFO(F("  Channel "), channel.ID, F(" not configured"));
+
+    RLConfigCacheHeader header;
+    RLConfigCacheRecord record;
+    uint32_t address = sizeof(header) + (uint32_t)index * CONFIG_CACHE_SLOT_SIZE;
+    if (ConfigCache == NULL ||
+        !ConfigCache->read(0, &header, sizeof(header)) ||
+        header.Magic != CONFIG_CACHE_MAGIC ||
+        header.Version != CONFIG_CACHE_VERSION ||
+        header.ChannelCount != ChannelCount ||
+        !ConfigCache->read(address, &record, sizeof(record)) ||
+        record.Hash == 0)
+        return;
+    memset(&record, 0, sizeof(record));
+    if (!ConfigCache->write(address, &record, sizeof(record)) || !ConfigCache->flush())
+        RL_LOG_WARN(F("[Warning] Cached configuration of channel "), channel.ID, F(" could not be cleared"));
+}
+
+// Configure a channel from its slot in the configuration cache, returns false if the slot is empty or invalid
+bool RLNodeBase::loadChannelConfig(int index)
+{
+    RLConfigCacheHeader header;
+    RLConfigCacheRecord record;
+    uint32_t address = sizeof(header) + (uint32_t)index * CONFIG_CACHE_SLOT_SIZE;
+    if (!ConfigCache->read(0, &header, sizeof(header)) ||
+        header.Magic != CONFIG_CACHE_MAGIC ||
+        header.Version != CONFIG_CACHE_VERSION ||
+        header.ChannelCount != ChannelCount ||
+        !ConfigCache->read(address, &record, sizeof(record)) ||
+        record.Length > CONFIG_CACHE_SLOT_SIZE - sizeof(record))
+        return false;
+
+    // The cached Configuration object is wrapped in a message, the way updateConfig() expects it in JsonDoc
+    const size_t prefixLength = sizeof(CONFIG_CACHE_PREFIX) - 1;
+    char message[sizeof(CONFIG_CACHE_PREFIX) + CONFIG_CACHE_SLOT_SIZE + 2];
+    char* config = message + prefixLength;
+    memcpy(message, CONFIG_CACHE_PREFIX, prefixLength);
+    if (!ConfigCache->read(address + sizeof(record), config, record.Length) ||
+        configHash(config, record.Length) != record.Hash)
+        return false;
+    strcpy(config + record.Length, "}}");
+
+    JsonDoc.clear();
+    if (deserializeJson(JsonDoc, message))
+    {
+        JsonDoc.clear();
+        return false;
+    }
+    RLChannel& channel = *Channels[index];
+    RL_LOG_INFO(F("  Channel "), channel.ID, F(" configured from the configuration cache"));
+    channel.updateConfig();
+    channel.ConfigHash = record.Hash;
+    channel.ConfigFromCache = true;
+    JsonDoc.clear();
+    return true;
+}
+
+// Write a configuration to the slot of a channel, unchanged configurations are not written again
+// The record is written after the configuration, a slot interrupted by a reset does not match its hash
+// Flushed once at the end, so a configuration costs one commit on EEPROM emulated in flash
+bool RLNodeBase::saveChannelConfig(int index, const char* config, size_t length, uint32_t hash)
+{
+    RLConfigCacheHeader header;
+    RLConfigCacheRecord record;
+    uint32_t address = sizeof(header) + (uint32_t)index * CONFIG_CACHE_SLOT_SIZE;
+    if (address + CONFIG_CACHE_SLOT_SIZE > ConfigCache->size())
+        return false;
+    if (!ConfigCache->read(0, &header, sizeof(header)) ||
+        header.Magic != CONFIG_CACHE_MAGIC ||
+        header.Version != CONFIG_CACHE_VERSION ||
+        header.ChannelCount != ChannelCount)
+    {
+        // New or outdated cache, invalidate all slots before the header is written
+        memset(&record, 0, sizeof(record));
+        for (int i = 0; i < ChannelCount; i++)
+        {
+            ConfigCache->write(sizeof(header) + (uint32_t)i * CONFIG_CACHE_SLOT_SIZE, &record, sizeof(record));
+        }
+        header.Magic = CONFIG_CACHE_MAGIC;
+        header.Version = CONFIG_CACHE_VERSION;
+        header.ChannelCount = ChannelCount;
+        if (!ConfigCache->write(0, &header, sizeof(header)))
+            return false;
+    }
+    else if (ConfigCache->read(address, &record, sizeof(record)) && record.Hash == hash && record.Length == length)
+        return true;
+
+    record.Hash = hash;
+    record.Length = length;
+    return ConfigCache->write(address + sizeof(record), config, length) &&
+           ConfigCache->write(address, &record, sizeof(record)) &&
+           ConfigCache->flush();
+}
+
+// Publish the samples buffered by channels that are sampled from interrupts
+void RLNodeBase::drainAcquisition()
+{
+    for (int i = 0; i < ChannelCount; i++)
+    {
+        if (Channels[i]->usesAcquisition())
+            Channels[i]->drainAcquisition();
+    }
+}
+
+// Publish stored samples once the broker can be reached again,
+// one message every STORE_DRAIN_INTERVAL with up to MAX_BATCH_SIZE samples from the same channel
+void RLNodeBase::drainStore()
+{
+    if (Store->count() == 0 || !Session->Mqtt.connected() ||
+        Time - LastDrainTime < ((unsigned long)STORE_DRAIN_INTERVAL << Congestion))
+        return;
+    LastDrainTime = Time;
+
+    RLSample samples[MAX_BATCH_SIZE];
+    RLStoredSample stored;
+    Store->read(0, stored);
+    int channel = stored.Channel;
+    unsigned int count = 0;
+    do
+    {
+        samples[count++] = stored.Sample;
+    } while (count < MAX_BATCH_SIZE && Store->read(count, stored) && stored.Channel == channel);
+
+    // Samples from channels that have been removed or deactivated are dropped
+    if (channel < 1 || channel > ChannelCount || !Channels[channel - 1]->isActive() ||
+        publishSamples(*Channels[channel - 1], samples, count))
+    {
+        Store->remove(count);
+    }
+}
 
-    serializeJson(nodeInformation, SerializedJson);
+// Publish json to topic
+void RLNodeBase::mqttPublishJson(const char* topic)
+{
+    // Serialized straight to the MQTT client, so no copy of the message is kept
+    // and messages may be larger than the MQTT buffer
+    size_t length = measureJson(NodeInformation);
+    bool published = Session->Mqtt.beginPublish(topic, length, false);
+    if (published)
+    {
+        RLChunkedPrint output(Session->Mqtt);
+        serializeJson(NodeInformation, output);
+        published = output.sendChunk() && Session->Mqtt.endPublish();
+    }
 
-    // Attempt to publish JSON to the response topic
-    if (!mqttClient.publish(topic, SerializedJson))
+    // Not retried or delayed, a failed publish is reported by the congestion control of the data publishes
+    if (!published)
     {
-        Serial.println(F("[Error] Failed to send."));
-        delay(500);
+        RL_LOG_ERROR(F("[Error] Failed to send."));
     }
 }
 
 // Create and send response to identification poll
-void RLNode::responseIdentificationPoll()
+void RLNodeBase::responseIdentificationPoll()
 {
     // Set response topic and correlation data
-    strcpy(ResponseTopic, jsonDoc["ResponseTopic"]);
-    strcpy(CorrelationData, jsonDoc["CorrelationData"]);
-    nodeInformation["CorrelationData"] = CorrelationData;
+    beginCommand();
 
     // Send processing message
-    nodeInformation["CmdStatus"] = "Processing";
-    nodeInformation["CmdStatusText"] = "";
-    nodeInformation["Payload"] = NULL;
-    mqttPublishJson(ResponseTopic);
+    NodeInformation["Payload"] = NULL;
+    replyCommand("Processing", "");
 
     // Send node information over given response topic
-    nodeInformation["CmdStatus"] = "Done";
-    nodeInformation["Payload"]["NodeName"] = NodeName;
-    //nodeInformation["Payload"]["NodeLocation"] = NodeLocation;
-    nodeInformation["Payload"]["MAC"] = MAC;
-    mqttPublishJson(ResponseTopic);
-    nodeInformation.clear();
+    NodeInformation["Payload"]["NodeName"] = NodeName;
+    //NodeInformation["Payload"]["NodeLocation"] = NodeLocation;
+    NodeInformation["Payload"]["MAC"] = MAC;
+    replyCommand("Done", "");
 }
+void RLNodeBase::responseSetNodeConfig()
+{
+    beginCommand();
+    JsonVariant name = JsonDoc["Payload"]["NodeName"];
+    if (!name.is<const char*>())
+    {
+        replyCommand("Error", "NodeName missing");
+        return;
+    }
+    strncpy(NodeName, name.as<const char*>(), MAX_GENERAL_STRING_LENGTH - 1);
+    NodeName[MAX_GENERAL_STRING_LENGTH - 1] = '\0';
+    RL_LOG_INFO(F("  Node name set to "), NodeName);
 
-// Indicates the node have gotten new configurations
-void RLNode::nodeConfigChanged()
+    NodeInformation["Payload"]["NodeName"] = NodeName;
+    NodeInformation["Payload"]["MAC"] = MAC;
+    replyCommand("Done", "");
+}
+// Apply a pushed configuration to one channel, {"Payload":{"ChannelId":id,"Configuration":{...}}}
+// The other channels keep running, SampleRate 0 stops the channel
+void RLNodeBase::responseSetChannelConfig()
 {
-    Serial.println(F("  Configuration changed"));
-    Serial.println(F("  Fetching new configurations"));
-    while(!GetChannelConfig())
+    beginCommand();
+    int channelID = JsonDoc["Payload"]["ChannelId"] | 0;
+    JsonObject config = JsonDoc["Payload"]["Configuration"];
+    if (channelID < 1 || channelID > ChannelCount)
     {
-        delay(10000);
+        replyCommand("Error", "ChannelId invalid");
+        return;
+    }
+    if (config.isNull())
+    {
+        replyCommand("Error", "Configuration missing");
+        return;
+    }
+    RLChannel& channel = *Channels[channelID - 1];
+    float sampleRate = config["SampleRate"] | 0.0f;
+    if (sampleRate < 0 || sampleRate > channel.MaxSampleRate)
+    {
+        replyCommand("Error", "SampleRate invalid");
+        return;
+    }
+    const char* publishTopic = config["PublishTopic"] | "";
+    if (sampleRate > 0 && (publishTopic[0] == '\0' || strlen(publishTopic) >= TopicLength))
+    {
+        replyCommand("Error", "PublishTopic invalid");
+        return;
+    }
+    if (strlen(config["Unit"] | "") >= MAX_SHORT_STRING_LENGTH ||
+        strlen(config["Sensor_ID"] | "") >= MAX_SHORT_STRING_LENGTH ||
+        strlen(config["Descriptor"] | "") >= MAX_DESCRIPTION_LENGTH)
+    {
+        replyCommand("Error", "Configuration value too long");
+        return;
     }
-    Serial.println(F("  Done changing config"));
 
-    int i;
-    for (i = 0; i < ChannelCount; i++)
+    RL_LOG_INFO(F("  Configuration of channel "), channelID, F(" set"));
+    applyChannelConfig(channelID - 1);
+    if (sampleRate > 0 && !channel.isActive())
     {
-        strcpy(Channels[i]->PreviousOutputString, "");
+        replyCommand("Error", "PublishTopic does not fit in the topic pool");
+        return;
     }
-    
+    // Publish the next value of the channel with the new configuration
+    strcpy(channel.PreviousOutputString, "");
+    NodeInformation["Payload"]["ChannelId"] = channelID;
+    NodeInformation["Payload"]["Status"] = channel.isActive() ? "Online" : "Idle";
+    replyCommand("Done", "");
+}
+// Read the response topic and correlation data of an incoming command, used by replyCommand()
+void RLNodeBase::beginCommand()
+{
+    buildTopic(ResponseTopic, JsonDoc["ResponseTopic"] | "");
+    strncpy(CorrelationData, JsonDoc["CorrelationData"] | "", MAX_GENERAL_STRING_LENGTH - 1);
+    CorrelationData[MAX_GENERAL_STRING_LENGTH - 1] = '\0';
+}
+// Send a status message for the current command, with the payload set in NodeInformation
+void RLNodeBase::replyCommand(const char* status, const char* text)
+{
+    if (ResponseTopic[0] != '\0')
+    {
+        NodeInformation["CorrelationData"] = CorrelationData;
+        NodeInformation["CmdStatus"] = status;
+        NodeInformation["CmdStatusText"] = text;
+        mqttPublishJson(ResponseTopic);
+    }
+    NodeInformation.clear();
+}
+void RLNodeBase::nodeConfigChanged()
+{
+    RL_LOG_INFO(F("  Configuration changed"));
+    RL_LOG_INFO(F("  Fetching new configurations"));
+    // A fetch that has not been started yet will already get the new configurations
+    for (int i = 0; i < RequestCount; i++)
+    {
+        RLRequest& request = Requests[(RequestHead + i) % MAX_QUEUED_REQUESTS];
+        if (request.Type == REQUEST_CHANNEL_CONFIG && (i > 0 || request.Next == 0))
+            return;
+    }
+    fetchChannelConfig(NULL);
 }
 
 // Generates a string of random characters to use for correlation data
-void RLNode::generateCorrelationData()
+void RLNodeBase::generateCorrelationData()
 {
     char data[MAX_GENERAL_STRING_LENGTH];
     memset(data, 0, sizeof(data));
@@ -659,62 +2386,118 @@ void RLNode::generateCorrelationData()
     strcpy(CorrelationData, data);
 }
 
-// Construct topic names
-void RLNode::setSubscriptionTopicNames()
+// Construct topic names, once since the fixed topics stay in the topic pool
+void RLNodeBase::setSubscriptionTopicNames()
 {
+    if (Topic_Response[0] != '\0')
+        return;
+    // Response: res/rtl/<MAC>/, followed by the request name
+    Topic_Response = addFixedTopic("res/rtl/", LowerCaseMAC, "/");
     // identificationPoll: <Root>/identificationpoll
-    strcpy(Topic_IdentificationPoll, "req/rtl/logger/identificationpoll");
+    Topic_IdentificationPoll = addFixedTopic("req/rtl/logger/identificationpoll");
     // SetNodeConfiguration: <Root>/<MAC>/identificationassignment (should probably be changed)
-    strcpy(Topic_SetNodeConfig, "req/rtl/");
-    strcat(Topic_SetNodeConfig, LowerCaseMAC);
-    strcat(Topic_SetNodeConfig, "/identificationassignment");
+    Topic_SetNodeConfig = addFixedTopic("req/rtl/", LowerCaseMAC, "/identificationassignment");
     // SetChannelConfiguration: <Root>/<MAC>/setchannelconfiguration
-    strcpy(Topic_SetChannelConfig, "req/rtl/");
-    strcat(Topic_SetChannelConfig, LowerCaseMAC);
-    strcat(Topic_SetChannelConfig, "/setchannelconfiguration");
+    Topic_SetChannelConfig = addFixedTopic("req/rtl/", LowerCaseMAC, "/setchannelconfiguration");
     // NodeConfigChanged: not/rtl/<MAC>/nodeconfigchanged
-    strcpy(Topic_NodeConfigChanged, "not/");
-    strcat(Topic_NodeConfigChanged, MAC);
-    strcat(Topic_NodeConfigChanged, "/configuration");
+    Topic_NodeConfigChanged = addFixedTopic("not/", MAC, "/configuration");
+    // Diagnostics: not/<MAC>/diagnostics
+    Topic_Diagnostics = addFixedTopic("not/", MAC, "/diagnostics");
+
+    // Route the topics to their handlers, the topics are not changed after this
+    ResponsePrefixLength = strlen(Topic_Response);
+    addRoute(Topic_IdentificationPoll, ROUTE_IDENTIFICATION_POLL, NULL);
+    addRoute(Topic_SetNodeConfig, ROUTE_SET_NODE_CONFIG, NULL);
+    addRoute(Topic_SetChannelConfig, ROUTE_SET_CHANNEL_CONFIG, NULL);
+    addRoute(Topic_NodeConfigChanged, ROUTE_NODE_CONFIG_CHANGED, NULL);
 }
 
-// Reconnects too the mqtt broker
-void RLNode::RLNodeMqttReconnect(const char* mac)
+// Add a topic of up to three strings to the fixed topics of the topic pool, "" if it does not fit
+const char* RLNodeBase::addFixedTopic(const char* first, const char* second, const char* third)
 {
-    // Loop until reconnected
-    while (!mqttClient.connected()) {
-        Serial.println(F("Attempting to reconnect to MQTT broker..."));
-        Serial.println(F("MAC       :User       :Pass"));
-        Serial.print(mac);
-        Serial.print(MQTTUsername);
-        Serial.println(MQTTPassword);
-        // Attempt to connect
-        if (mqttClient.connect(mac, MQTTUsername, MQTTPassword)) {
-            Serial.println(F("Connection to MQTT broker [Established]"));
-            mqttClient.subscribe(Topic_IdentificationPoll);
-            mqttClient.subscribe(Topic_SetNodeConfig);
-            mqttClient.subscribe(Topic_SetChannelConfig);
-        } else {
-            Serial.println(F("Connection to MQTT broker [Failed]"));
-            Serial.println(F("  retrying in 5 seconds"));
-            delay(5000);
-        }
+    const char* topic = TopicPool.addFixed(first, second, third);
+    if (topic != NULL)
+        return topic;
+    RL_LOG_ERROR(F("[Error] Topic pool full, topic not set: "), first, second, third);
+    return "";
+}
+
+// Concatenate up to three strings into a topic buffer, truncated to fit TopicLength
+void RLNodeBase::buildTopic(char* topic, const char* first, const char* second, const char* third)
+{
+    strncpy(topic, first, TopicLength - 1);
+    topic[TopicLength - 1] = '\0';
+    strncat(topic, second, TopicLength - 1 - strlen(topic));
+    strncat(topic, third, TopicLength - 1 - strlen(topic));
+}
+
+// Reconnects to the mqtt broker through the session, see RLMqttSession::reconnect()
+// and restores the subscriptions of the node when the session has a new connection
+void RLNodeBase::RLNodeMqttReconnect(const char* mac)
+{
+    if (!Session->Mqtt.connected())
+        Session->reconnect(mac, MQTTUsername[0] != '\0' ? MQTTUsername : NULL,
+                           MQTTPassword[0] != '\0' ? MQTTPassword : NULL);
+
+    // Subscribe again on every new connection, also when it was made by another node in the session
+    if (Session->Mqtt.connected() && SessionConnection != Session->Connections)
+    {
+        SessionConnection = Session->Connections;
+        if (HasConnected)
+            Diagnostics.Reconnects++;
+        HasConnected = true;
+        onConnected();
     }
 }
 
-// ****************************************************************
-// External
-// Reroutes the callback for mqtt subscriptions to the callback in logNode
-void RLNodeMqttCallback(char* topic, byte* payload, unsigned int length)
-{
-    Serial.print(F("Recieved "));
-    Serial.print(length);
-    Serial.print(F("/"));
-    Serial.print(mqttClient.getBufferSize());
-    Serial.print(F(" bytes on ("));
-    Serial.print(topic);
-    Serial.println(F(")."));
-
-    // Call object specific callback function
-    logNode.mqttCallback(topic, (char*)payload);
-}
\ No newline at end of file
+// Restore all subscriptions after a (re)connect
+void RLNodeBase::onConnected()
+{
+    for (int i = 0; i < SubscriptionCount; i++)
+    {
+        Session->Mqtt.subscribe(Subscriptions[i]);
+    }
+    // Responses to exchanges in flight should still reach the node
+    ResponseSubscribed = false;
+    if (RequestCount > 0)
+    {
+        buildTopic(Topic_Scratch, Topic_Response, RequestNames[Requests[RequestHead].Type]);
+        ResponseSubscribed = Session->Mqtt.subscribe(Topic_Scratch);
+    }
+
+    // The congestion stage from before the outage says nothing about the new connection
+    CongestionTime = Time;
+    CongestionClear = 0;
+    IntervalPublishes = 0;
+    IntervalFailures = 0;
+    IntervalLatency = 0;
+    if (Congestion != CONGESTION_NONE)
+    {
+        Congestion = CONGESTION_NONE;
+        RL_LOG_INFO(F("Congestion stage reset on reconnect"));
+        publishRateControl();
+    }
+}
+
+// Subscribe to topic and add it to the topics restored after a reconnect
+bool RLNodeBase::subscribe(const char* topic)
+{
+    int i;
+    for (i = 0; i < SubscriptionCount; i++)
+    {
+        if (!strcmp(Subscriptions[i], topic))
+            break;
+    }
+    if (i == SubscriptionCount)
+    {
+        if (SubscriptionCount >= MAX_SUBSCRIPTIONS)
+        {
+            RL_LOG_ERROR(F("[Error] Too many subscriptions"));
+            return false;
+        }
+        Subscriptions[SubscriptionCount++] = topic;
+    }
+    if (!Session->Mqtt.connected())
+        return true;
+    return Session->Mqtt.subscribe(topic);
+}
@@ -22,87 +22,527 @@
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include "Client.h"
+#include "RLStorage.h"
+#include "RLLog.h"
+#include "RLSpscRing.h"
+#include "RLBinaryCodec.h"
+#include "RLTopicPool.h"
 
 
 #define MAX_GENERAL_STRING_LENGTH 20
 #define MAX_SHORT_STRING_LENGTH 10
 #define MAX_TOPIC_LENGTH 128
 #define MAX_DESCRIPTION_LENGTH 50
-#define MAX_CHANNEL_COUNT 4
-#define MAX_JSON_SIZE 812
-#define MAX_SERIALIZED_JSON_SIZE 812
-#define MAX_RES_TIME_OUT 30000
+#define MAX_CHANNEL_COUNT 4  // Default channel capacity of RLNode
+#define MAX_JSON_SIZE 812  // Default JSON document and MQTT buffer size of RLNode
+#define JSON_FILTER_SIZE 192  // Size of the filter documents used when parsing incoming messages
+#define PUBLISH_CHUNK_SIZE 64  // Bytes buffered at a time when JSON is serialized to the MQTT client
+// Request timeouts, can be defined by the build (e.g. -DMAX_RES_TIME_OUT=1000) or changed with setRequestTimeouts()
+#ifndef MAX_RES_TIME_OUT
+#define MAX_RES_TIME_OUT 30000  // Time in ms to wait for a response before a request is sent again
+#endif
+#ifndef REQUEST_RETRY_DELAY
+#define REQUEST_RETRY_DELAY 10000  // Delay in ms before a request that timed out is sent again
+#endif
+#ifndef MAX_REQUEST_ATTEMPTS
+#define MAX_REQUEST_ATTEMPTS 0  // Attempts per exchange before a request is reported as failed, 0 retries forever
+#endif
+#define MAX_QUEUED_REQUESTS 4
+#define CHANNEL_ACTIVATION_DELAY 1000  // Delay in ms after (re)configuration before a channel starts publishing
+#define MAX_BATCH_SIZE 8  // Max number of samples collected into one batch message
+#define MAX_BATCH_PAYLOAD_SIZE (MAX_BATCH_SIZE * (MAX_GENERAL_STRING_LENGTH + 16) + 56)
+#define MAX_BINARY_PAYLOAD_SIZE (MAX_BATCH_SIZE * BINARY_CODEC_SAMPLE_SIZE + BINARY_CODEC_HEADER_SIZE)
+#define MAX_PUBLISH_RATE 1000  // Max PublishRate of aggregated channels, a window is at least 1 ms
+#define AGGREGATE_PAYLOAD_SIZE 256  // Size of an aggregate window message, all reducers in exponent form take about 200
+#define ACQUISITION_BUFFER_SIZE 16  // Samples buffered between acquireFromISR() and loop(), a power of two
+#define SAMPLE_STORE_SIZE 16  // Samples kept in RAM while the broker can not be reached
+#define STORE_DRAIN_INTERVAL 50  // Min time in ms between messages with stored samples, doubled for each congestion stage
+#define CONGESTION_INTERVAL 1000  // Time in ms between evaluations of the uplink
+#define CONGESTION_MAX_LATENCY 50000  // Mean time in us of a publish above which the uplink is congested
+#define CONGESTION_STORE_FILL 50  // Fill of the sample store in percent above which the uplink is congested
+#define CONGESTION_RECOVERY 5  // Intervals without congestion before the node goes back one stage
+#define CONGESTION_DECIMATION 4  // Decimated channels publish one of this many samples
+#define CONGESTION_BATCH_INTERVAL 5000  // Max age in ms of batches collected because of congestion
+#define CONFIG_CACHE_SLOT_SIZE 256  // Bytes of the configuration cache for each channel, including the record header
+#define CONFIG_CACHE_VERSION 1  // Format of the configuration cache, a cache with another version is not used
+#define RECONNECT_MIN_DELAY 1000  // Delay in ms before the first reconnect attempt, doubled for each failed attempt
+#define RECONNECT_MAX_DELAY 60000
+#define MAX_SUBSCRIPTIONS 12  // Topics restored after a reconnect
+#define SESSION_BUCKETS 32  // Hash buckets used to find the node of a MAC in an MQTT session, a power of two
+#define SESSION_BROADCAST_SIZE 256  // Max payload of messages delivered to every node in a session
+#define MAX_TOPIC_ROUTES 12  // Topics handled by the node, including topics added with registerTopicHandler
+#define TOPIC_ROUTE_SLOTS 16  // Size of the routing hash table, a power of two larger than MAX_TOPIC_ROUTES
+#define TIME_SYNC_INTERVAL 600000  // Default time in ms between time sync requests, 0 disables them
+#define TIME_SYNC_MAX_ROUND_TRIP 2000  // Time sync responses slower than this (ms) are not used
+#define TIME_SYNC_MIN_DRIFT_INTERVAL 60000  // Min time in ms between time syncs used to estimate drift
+#define EPOCH_TIME_LENGTH 16  // Length of an epoch time formatted by formatEpochTime(), "seconds.mmm"
+#define DIAGNOSTICS_INTERVAL 60000  // Default time in ms between diagnostics messages, 0 disables them
+#define HISTOGRAM_BUCKETS 8
+#define SCHEDULER_IDLE_TIME 0x7FFFFFFFUL  // Returned by timeUntilNextDeadline() when no channel is active
+#define SCHEDULER_FRACTION_BITS 16  // Scheduler times are in ticks of 1/65536 us
+#define MICROS_TO_TICKS(us) ((uint64_t)(us) << SCHEDULER_FRACTION_BITS)
+#define NODE_TOPIC_COUNT 2  // Topic buffers in each node, the other topics are kept in the topic pool
+#define TOPIC_POOL_FIXED_SIZE 240  // Fixed node topics, about 210 bytes with a 12 character MAC
+#define TOPIC_POOL_CHANNEL_SIZE (MAX_TOPIC_LENGTH + 5)  // Publish topic of up to MAX_TOPIC_LENGTH - 1 characters, split in two records
+#define TOPIC_POOL_SIZE(channels) (TOPIC_POOL_FIXED_SIZE + (channels) * TOPIC_POOL_CHANNEL_SIZE)  // Default topic pool of RLNodeSized
 
 #define SENSOR_FUNCTION void (*sensorFunction)(char* outputString, float k, float m, bool* forcePublish)
-void intTochar(int int_current,char * outputString  );
+// Typed sensor functions return the raw value, the library applies calibration (value * k + m) and Precision
+#define FLOAT_SENSOR_FUNCTION float (*floatSensorFunction)(bool* forcePublish)
+#define INT_SENSOR_FUNCTION int32_t (*intSensorFunction)(bool* forcePublish)
+#define DEFAULT_PRECISION 2  // Decimals of values from typed sensor functions
+#define MAX_PRECISION 6
+#define REQUEST_CALLBACK void (*callback)(int result)
+#define TOPIC_HANDLER void (*topicHandler)(char* topic, byte* payload, unsigned int length)
+
+// Request types for requests to dataaccess
+#define REQUEST_NODE_STARTUP_INFO 0
+#define REQUEST_CHANNEL_PROPERTIES 1
+#define REQUEST_CHANNEL_CONFIG 2
+#define REQUEST_TIME_SYNC 3
+
+// States of an exchange (one request message and its response)
+#define EXCHANGE_IDLE 0
+#define EXCHANGE_WAITING 1  // Sent, waiting for a response
+#define EXCHANGE_PROCESSING 2  // "Processing" received, waiting for the final response
+#define EXCHANGE_RETRY 3  // Timed out, waiting to be sent again
+
+// Reducers of aggregate windows, set with "Reducers" in the channel configuration
+#define REDUCER_MIN 0x01
+#define REDUCER_MAX 0x02
+#define REDUCER_MEAN 0x04
+#define REDUCER_RMS 0x08
+#define REDUCER_COUNT 0x10
+#define DEFAULT_REDUCERS (REDUCER_MIN | REDUCER_MAX | REDUCER_MEAN)
+
+// Deadband modes for report-by-exception
+#define DEADBAND_ABSOLUTE 0  // Deadband in the unit of the value
+#define DEADBAND_RELATIVE 1  // Deadband as a fraction of the latest published value
+
+// Congestion stages, the node moves one stage per CONGESTION_INTERVAL while the uplink is congested
+// A lost connection to the broker is an outage, not congestion, the stage is kept and reset on reconnect
+#define CONGESTION_NONE 0
+#define CONGESTION_BATCH 1  // Every channel collects batches of MAX_BATCH_SIZE samples
+#define CONGESTION_DECIMATE 2  // Channels below the highest priority are decimated
+#define CONGESTION_DROP 3  // Channels below the highest priority are dropped, the others are decimated
+
+// Sample encodings, set with "Encoding" in the channel configuration
+#define ENCODING_TEXT 0  // Values as strings, batches as JSON sample messages
+#define ENCODING_BINARY 1  // Binary sample messages with delta and varint packed values, see RLBinaryCodec.h
+
+// Handlers of routed topics
+#define ROUTE_USER 0  // Handler registered with registerTopicHandler, gets the raw payload
+#define ROUTE_IDENTIFICATION_POLL 1
+#define ROUTE_SET_NODE_CONFIG 2
+#define ROUTE_SET_CHANNEL_CONFIG 3
+#define ROUTE_NODE_CONFIG_CHANGED 4
+#define ROUTE_RESPONSE 5  // Responses to requests, matched by prefix and not in the routing table
+
+void intTochar(long int_current,char * outputString  );
+void floatTochar(float value, int precision, char* outputString);
+
+// A sensor value together with the time (millis) it was read
+struct RLSample
+{
+    unsigned long Time;
+    char Value[MAX_GENERAL_STRING_LENGTH];
+};
+
+// A raw value read by acquireFromISR(), calibrated and formatted when loop() publishes it
+struct RLAcquiredSample
+{
+    unsigned long Time;
+    union
+    {
+        float FloatValue;  // From a float sensor function
+        int32_t IntValue;  // From an int sensor function
+    };
+    bool Force;  // forcePublish set by the sensor function
+};
+
+typedef RLSpscRing<RLAcquiredSample, ACQUISITION_BUFFER_SIZE> RLAcquisitionBuffer;
+
+// A sample waiting to be published, Channel is the channel ID
+struct RLStoredSample
+{
+    int Channel;
+    RLSample Sample;
+};
+
+// Layout of the configuration cache: a header followed by one slot of CONFIG_CACHE_SLOT_SIZE bytes per channel,
+// each slot is a record followed by the Configuration object of the channel as JSON
+struct RLConfigCacheHeader
+{
+    uint32_t Magic;
+    uint16_t Version;  // CONFIG_CACHE_VERSION
+    uint16_t ChannelCount;
+};
+
+struct RLConfigCacheRecord
+{
+    uint32_t Hash;  // Hash of the JSON, an erased or partly written slot does not match
+    uint16_t Length;
+};
+
+class RLNodeBase;
+
+// Build sample messages, used for batches and stored samples
+// {"Age":ms,"Time":epoch,"Samples":[[dt,"value"],...]}, Time is only included when the node clock is synced
+void beginSampleMessage(char* payload, unsigned long firstTime, RLNodeBase& node);
+void appendSampleMessage(char* payload, const RLSample& sample, unsigned long firstTime, bool first);
+void endSampleMessage(char* payload);
+// Binary sample message, see RLBinaryCodec.h, returns 0 if a value is not a decimal number
+size_t encodeSampleMessage(uint8_t* payload, size_t size, const RLSample* samples, int count, RLNodeBase& node);
+
+// Latency histogram with fixed buckets,
+// bucket i counts values below 4^i (in the unit of the measurement) and the last bucket counts the rest
+struct RLHistogram
+{
+    uint16_t Counts[HISTOGRAM_BUCKETS];
+    void add(unsigned long value);
+    void clear();
+};
+
+// Performance counters for a channel, since the latest diagnostics message
+struct RLChannelDiagnostics
+{
+    unsigned long Samples;
+    unsigned long Publishes;
+    unsigned long PublishFailures;
+    unsigned long Suppressed;  // Samples not published since the value had not changed
+    unsigned long Decimated;  // Samples not published because of congestion
+    RLHistogram SensorTime;  // Duration of the sensor function in us
+    RLHistogram Jitter;  // Delay in us between the deadline and the sample
+};
+
+// Performance counters for the node, since the latest diagnostics message
+struct RLNodeDiagnostics
+{
+    unsigned long Loops;
+    unsigned long PublishFailures;
+    unsigned long Reconnects;
+    RLHistogram LoopPeriod;  // Time between loop() calls in us
+};
+
+// ******************************************************************
+// Sample store interface
+// Bounded FIFO of samples that could not be published, drained when the broker is reachable again
+class RLSampleStore
+{
+public:
+    virtual bool push(const RLStoredSample& sample) = 0;  // Returns false if the store is full
+    virtual bool read(unsigned int index, RLStoredSample& sample) = 0;  // index 0 is the oldest sample
+    virtual void remove(unsigned int count) = 0;  // Remove the count oldest samples
+    virtual unsigned int count() = 0;
+    virtual unsigned int capacity() = 0;
+};
+
+// Ring buffer in RAM, used by default
+class RLRamSampleStore : public RLSampleStore
+{
+public:
+    bool push(const RLStoredSample& sample);
+    bool read(unsigned int index, RLStoredSample& sample);
+    void remove(unsigned int count);
+    unsigned int count() { return Count; }
+    unsigned int capacity() { return SAMPLE_STORE_SIZE; }
+protected:
+    RLStoredSample Samples[SAMPLE_STORE_SIZE];
+    unsigned int Head = 0;
+    unsigned int Count = 0;
+};
+
+// Ring buffer in flash, EEPROM or a file, see RLStorage.h, for more samples than fit in RAM
+// Head and Count are kept in RAM, so like the RAM store it is empty after a reset. The writes are never
+// flushed, the samples stay in the buffers of the backend as far as it has them, to spare the flash
+class RLStorageSampleStore : public RLSampleStore
+{
+public:
+    RLStorageSampleStore(RLStorage& storage);
+    bool push(const RLStoredSample& sample);
+    bool read(unsigned int index, RLStoredSample& sample);
+    void remove(unsigned int count);
+    unsigned int count() { return Count; }
+    unsigned int capacity() { return Capacity; }
+protected:
+    RLStorage& Storage;
+    unsigned int Capacity;
+    unsigned int Head = 0;
+    unsigned int Count = 0;
+};
+
+// A topic handled by the node, found by Hash in the routing table of the node
+struct RLTopicRoute
+{
+    const char* Topic;
+    uint16_t Length;
+    uint16_t Hash;
+    uint8_t Handler;  // ROUTE_*
+    void (*Callback)(char* topic, byte* payload, unsigned int length);  // Used by ROUTE_USER
+};
+
 // ******************************************************************
 // Base channel class (Abstract)
 // Includes common functions and attributes needed for each channel
 class RLChannel
 {
 private:
-    SENSOR_FUNCTION;
+    // One of the sensor functions is set, the others are NULL
+    SENSOR_FUNCTION = NULL;
+    FLOAT_SENSOR_FUNCTION = NULL;
+    INT_SENSOR_FUNCTION = NULL;
 public:
     // Base constructor for general channel setup
     RLChannel(const char* type, const float maxSampleRate, SENSOR_FUNCTION);
+    RLChannel(const char* type, const float maxSampleRate, FLOAT_SENSOR_FUNCTION);
+    RLChannel(const char* type, const float maxSampleRate, INT_SENSOR_FUNCTION);
     RLChannel& setSensorFunction(SENSOR_FUNCTION);
+    RLChannel& setSensorFunction(FLOAT_SENSOR_FUNCTION);
+    RLChannel& setSensorFunction(INT_SENSOR_FUNCTION);
     void addChannelConfig();  // Add/update channel configuration information to JSON structure
     void addChannelPropertiesByID();  // Add/update channel properties to JSON structure
     void updateConfig();  // Update information about channel and current configuration
-    void publishData();  // Update loop, check if channel should send a value
-    unsigned long PreviousTime;  // Used to avoid publishing multiple times in the same millisecond
+    void publishData();  // Read the sensor and publish, called by the node scheduler when the channel is due
+    void forcePublish();  // Request a sample outside of the regular schedule
+    // Interrupt driven acquisition, the channel is sampled by calling acquireFromISR() from a timer interrupt
+    // instead of by the scheduler, and loop() publishes the buffered samples
+    // Only typed sensor functions can be used, the timer sets the sample rate, NULL returns to scheduled sampling
+    RLChannel& setAcquisitionBuffer(RLAcquisitionBuffer* buffer);
+    bool acquireFromISR();
+    bool usesAcquisition() { return Acquisition != NULL; }
+    void drainAcquisition();  // Publish the buffered samples, called by loop()
+    // Publish the batch when its oldest sample is BatchInterval ms old, called by loop()
+    // so a batch is not held until the channel is sampled again
+    void flushBatch();
+    unsigned long batchTimeLeft();  // Time in ms until the batch must be published, SCHEDULER_IDLE_TIME if never
+    bool isActive() { return Active; }
+    // Built from the topic pool into Topic_Scratch of the node, valid until the next topic is built there
+    const char* getPublishTopic();
+    uint8_t getEncoding() { return Encoding; }
+    int getPriority() { return Priority; }
+    // Messages per second that are published: one per window for aggregated channels, otherwise the
+    // sample rate lowered by decimation and by the samples the deadband has suppressed lately
+    float effectiveRate();
+    unsigned long PreviousTime = 0;  // Time of the latest publish
     unsigned long ActivationTime;  // Used for adding a delay to channel after reconfiguration
+    uint64_t NextDueTime;  // Scheduler time when the channel should be sampled next
+    uint64_t Period = 0;  // Sample period in scheduler ticks, set from SampleRate in updateConfig
     int ID;
+    RLNodeBase* Node = NULL;  // Set when the channel is added to a node
     float MaxSampleRate = 0.0f;
-    char PreviousOutputString[MAX_GENERAL_STRING_LENGTH];
+    char PreviousOutputString[MAX_GENERAL_STRING_LENGTH] = "";  // Latest published value, cleared to publish the next sample
+    RLChannelDiagnostics Diagnostics = RLChannelDiagnostics();
+    void addDiagnostics();  // Add diagnostics to JSON structure and clear the counters
+    uint32_t ConfigHash = 0;  // Hash of the latest configuration from dataaccess or the configuration cache
+    bool ConfigFromCache = false;  // Started from the configuration cache, not yet confirmed by dataaccess
 protected:
     bool Active = false;  // Determines if the channel should publish or not
     // Configurations
-    char PublishTopic[MAX_TOPIC_LENGTH] = "\0";
+    uint8_t PublishTopic = TOPIC_NONE;  // Handle in the topic pool of the node
     float SampleRate = 0.0f;
-    float CalibrationValueK = 0.0f;
+    float CalibrationValueK = 1.0f;
     float CalibrationValueM = 0.0f;
+    int Precision = DEFAULT_PRECISION;  // Decimals of values from typed sensor functions
     // Properties
     char Type[MAX_GENERAL_STRING_LENGTH] = "\0";
     char Status[MAX_SHORT_STRING_LENGTH] = "Idle";
     char Sensor_ID[MAX_SHORT_STRING_LENGTH] = "\0";
     char Description[MAX_DESCRIPTION_LENGTH] = "\0";
     char Unit[MAX_SHORT_STRING_LENGTH] = "\0";
+    bool Forced = false;  // Set by forcePublish, cleared when the sample has been published
+    // Report-by-exception, a sample is only published if it differs from the latest published value
+    // by more than Deadband, or if Heartbeat ms have passed since the latest publish
+    // Both 0 publishes every sample, Deadband 0 with a Heartbeat publishes every changed value
+    float readSensor(char* outputString, bool* forcePublish);
+    float formatValue(float raw, char* outputString);
+    float formatValue(int32_t raw, char* outputString);
+    void processSample(const char* outputString, float value, bool forcePublish, unsigned long time);
+    RLAcquisitionBuffer* Acquisition = NULL;
+    bool isException(const char* outputString, float value);
+    float Deadband = 0.0f;
+    int DeadbandMode = DEADBAND_ABSOLUTE;
+    unsigned long Heartbeat = 0;
+    float PreviousValue = 0.0f;  // Numeric value of PreviousOutputString
+    bool Timestamps = false;  // Publish single samples as sample messages, which carry the epoch time
+    uint8_t Encoding = ENCODING_TEXT;  // ENCODING_BINARY publishes every sample as a binary sample message
+    // Rate control, channels with a lower Priority are decimated and dropped first when the uplink is congested
+    uint8_t decimation();  // Samples per published sample, 0 if all samples are dropped
+    int Priority = 0;
+    unsigned long DecimationCount = 0;
+    // Aggregation, when PublishRate is set the channel is sampled at SampleRate and the samples are reduced
+    // over windows of 1 / PublishRate seconds, each window is published as one message
+    void addToWindow(float value, unsigned long time);
+    bool publishWindow();
+    void clearWindow();
+    float PublishRate = 0.0f;  // 0 publishes every sample
+    uint8_t Reducers = DEFAULT_REDUCERS;  // REDUCER_* flags
+    unsigned long WindowPeriod = 0;
+    unsigned long WindowStart = 0;
+    unsigned long WindowCount = 0;
+    float WindowMin = 0.0f;
+    float WindowMax = 0.0f;
+    double WindowSum = 0.0;
+    double WindowSumSquares = 0.0;
+    // Batching, samples are collected in a ring buffer and published as one message
+    // when BatchSize samples are collected or the oldest sample is BatchInterval ms old
+    void addToBatch(const char* value, unsigned long time);
+    bool publishBatch();
+    int BatchSize = 1;  // 1 disables batching
+    unsigned long BatchInterval = 0;  // 0 disables the time limit
+    RLSample Batch[MAX_BATCH_SIZE];
+    int BatchHead = 0;  // Index of the oldest sample
+    int BatchCount = 0;
 };
 
+// A queued request to dataaccess, made up of one exchange per channel (or one for node requests)
+struct RLRequest
+{
+    int Type;
+    int Next;  // Index of the next exchange to send
+    int Done;  // Number of finished exchanges
+    int Failed;  // Number of exchanges that got no response
+    bool Blocking;  // Result goes to BlockingRequestResult of the node
+    void (*Callback)(int result);
+};
+
+// An exchange in flight, matched with its response by CorrelationData
+struct RLExchange
+{
+    int State = EXCHANGE_IDLE;
+    int Index = 0;  // Channel index for channel requests
+    int Attempts = 0;
+    unsigned long Deadline = 0;  // Timeout, or time of next retry
+    unsigned long SentTime = 0;  // Time (millis) the request was sent
+    char CorrelationData[MAX_GENERAL_STRING_LENGTH] = "\0";
+};
+
+class RLMqttSession;
+
 // ****************************************************************
 // RLNode class
 // Handles the node as a whole and contains a list of connected channels
-class RLNode
+// RLNodeBase holds the implementation, use RLNode or RLNodeSized to get a node with its buffers
+class RLNodeBase
 {
+    friend class RLChannel;
+    friend class RLMqttSession;
 public:
+    // Use session for the MQTT connection instead of RLDefaultSession, call before begin()
+    // Nodes with the same session share one connection to the broker
+    void setSession(RLMqttSession& session);
+    RLMqttSession& getSession() { return *Session; }
+    ~RLNodeBase();
     // Connect to MQTT, set buffer size, set topic names, subscribe to topics, etc.
     void begin(Client& client, const char* mac, const char* server, uint16_t port);
     void begin(Client& client, const char* mac, const char* server, uint16_t port, const char* nodename);
     void begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username, const char* password);
     void begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username, const char* password, const char* nodename);
     void begin(Client& client, const char* mac, const char* server, uint16_t port, const char* username,const char* password, const char* nodename, const char* nodetype);
-    void addChannel(RLChannel* newChannel);
-    // Update loop, check for messages on MQTT and check if any channel should send a value
+    bool addChannel(RLChannel* newChannel);
+    // Update loop, check for messages on MQTT and sample the channels that are due
     void loop();
+    // Time in ms until the next channel is due or a batch must be published, 0 if one is already due
+    unsigned long timeUntilNextDeadline();
+    // Make the scheduler re-evaluate channel deadlines, called when a channel is (re)configured or forced
+    void rescheduleChannels();
+    // Non-blocking requests to dataaccess, handled by loop() and reported through callback (may be NULL)
+    bool sendNodeStartupInfo(REQUEST_CALLBACK);
+    bool sendChannelProperties(REQUEST_CALLBACK);
+    bool fetchChannelConfig(REQUEST_CALLBACK);
+    // Synchronize the node clock with dataaccess, done every setTimeSyncInterval() ms by loop()
+    // Not queued with the other requests and not retried, false if a time sync is already pending
+    bool syncTime(REQUEST_CALLBACK);
+    bool requestsPending();
+    void setPipelinedRequests(bool pipelined);
+    void setRequestTimeouts(unsigned long responseTimeout, unsigned long retryDelay);
+    void setStartupCallback(REQUEST_CALLBACK);
+    // Blocking versions of the requests above, channels keep publishing while waiting
+    // Return 0 if dataaccess has not answered within two response timeouts, and when called from a callback of loop()
     int SetNodeStartupInfo();
     int requestNodeConfig();
     int GetChannelConfig();
     int SetChannelProperties();
-    void mqttCallback(char* topic, char* payload);
-    void mqttPublishData(char* topic, char* payload);
-    void mqttPublishJson(char* topic);
+    // Incoming messages are parsed in place, JsonDoc points into the MQTT buffer until the next publish
+    void mqttCallback(char* topic, byte* payload, unsigned int length);
+    bool handlesTopic(const char* topic);  // True if mqttCallback has a handler for topic
+    bool mqttPublishData(const char* topic, const char* payload);
+    bool mqttPublishData(const char* topic, const uint8_t* payload, unsigned int length);
+    // Congestion stage of the uplink (CONGESTION_*), from publish time, publish failures and the sample store fill
+    uint8_t congestion() { return Congestion; }
+    unsigned long PublishLatency = 0;  // Mean time in us of a publish, over the latest CONGESTION_INTERVAL
+    // Publish samples of a channel as one sample message, in the encoding of the channel
+    bool publishSamples(RLChannel& channel, const RLSample* samples, int count);
+    void mqttPublishJson(const char* topic);
+    // Keep a sample that could not be published, it is published when the broker can be reached
+    void storeSample(int channel, const RLSample& sample);
+    void setSampleStore(RLSampleStore* store);
+    // Keep the channel configurations in storage, call before begin()
+    // begin() starts the channels from the cache and dataaccess confirms or replaces the configurations in the background
+    void setConfigCache(RLStorage* storage);
+    // Subscribe to topic now and after every reconnect, topic must stay valid while the node is running
+    bool subscribe(const char* topic);
+    // Call topicHandler with the raw payload of every message on topic, and subscribe to it
+    // topic must stay valid while the node is running, registering a topic again replaces its handler
+    bool registerTopicHandler(const char* topic, TOPIC_HANDLER);
+    // Publish performance counters on not/<MAC>/diagnostics every interval ms, 0 disables
+    void setDiagnosticsInterval(unsigned long interval);
+    void setTimeSyncInterval(unsigned long interval);
+    // Epoch time of a local time (millis), false until the first time sync
+    bool timeSynced() { return TimeSynced; }
+    bool epochTime(unsigned long localTime, unsigned long& seconds, unsigned int& milliseconds);
+    bool formatEpochTime(unsigned long localTime, char* output);  // "seconds.mmm", EPOCH_TIME_LENGTH bytes
+    unsigned long TimeSyncRoundTrip = 0;  // Round trip time in ms of the latest time sync
+    void publishDiagnostics();
+    // Fixed node topics and channel publish topics, footprint() is the RAM used for them
+    RLTopicPool& getTopicPool() { return TopicPool; }
+    RLNodeDiagnostics Diagnostics = RLNodeDiagnostics();
     unsigned long Time;
-    bool ResponseReceived = false;
+    // Time in ticks of 1/65536 us, micros() extended to 64 bits so it does not wrap
+    // Clock is updated once per loop(), schedulerTime() updates and returns it
+    uint64_t Clock = 0;
+    uint64_t schedulerTime();
 
 protected:
+    RLNodeBase(RLChannel** channels, RLExchange* exchanges, int channelCapacity,
+               JsonDocument& jsonDoc, JsonDocument& nodeInformation, size_t jsonSize,
+               char* topics, size_t topicLength, char* topicArena, size_t topicArenaSize,
+               uint16_t* topicEntries, uint8_t topicEntryCount);
     void responseIdentificationPoll();
     void responseSetNodeConfig();
     void responseSetChannelConfig();
     void nodeConfigChanged();
+    void beginCommand();
+    void replyCommand(const char* status, const char* text);
     void generateCorrelationData();
     void setSubscriptionTopicNames();
+    void buildTopic(char* topic, const char* first, const char* second = "", const char* third = "");
+    const char* addFixedTopic(const char* first, const char* second = "", const char* third = "");
+    bool addRoute(const char* topic, uint8_t handler, TOPIC_HANDLER);
+    RLTopicRoute* findRoute(const char* topic);
     void RLNodeMqttReconnect(const char* mac);
+    void onConnected();
+    void runScheduler();
+    void drainStore();
+    void drainAcquisition();
+    bool queueRequest(int type, REQUEST_CALLBACK);
+    int runBlockingRequest(int type);
+    void cancelBlockingRequest();
+    void pollRequests();
+    void sendExchange(RLExchange& exchange, int type);
+    RLExchange* findExchange();
+    void handleResponse(char* topic);
+    void pollTimeSync();
+    bool updateTimeSync(RLExchange& exchange);
+    void completeTimeSync(int result);
+    void completeRequest();
+    void recordPublish(bool published, unsigned long latency);
+    void updateCongestion();
+    void publishRateControl();
+    void applyChannelConfig(int index);
+    bool loadChannelConfig(int index);
+    bool saveChannelConfig(int index, const char* config, size_t length, uint32_t hash);
+    void removeChannelConfig(int index);
+    RLChannel* earliestChannel();
 
     char MAC[13] = "\0";  // MAC-address, used as identifier
     char LowerCaseMAC[13] = "\0";  // MAC-address, used as identifier
@@ -113,27 +553,143 @@ protected:
     // NodeLocation removed
     // char NodeLocation[MAX_TOPIC_LENGTH] = "\0";  // Node location, used to set unique topic name 
     char Status[MAX_SHORT_STRING_LENGTH] = "Idle";
-    char ResponseTopic[MAX_TOPIC_LENGTH] = "\0";  // Locally set from incoming messages
-    // Internal communication topics to listen to
-    char Topic_Response[MAX_TOPIC_LENGTH] = "\0";  // Response topic used in requests
-    char Topic_IdentificationPoll[MAX_TOPIC_LENGTH] = "\0";
-    char Topic_SetNodeConfig[MAX_TOPIC_LENGTH] = "\0";
-    char Topic_SetChannelConfig[MAX_TOPIC_LENGTH] = "\0";
-    char Topic_NodeConfigChanged[MAX_TOPIC_LENGTH] = "\0";
-    char SerializedJson[MAX_SERIALIZED_JSON_SIZE] = "\0";
+    // Topic buffers of TopicLength bytes and the arena of the topic pool, owned by RLNodeSized
+    size_t TopicLength;
+    char* ResponseTopic;  // Locally set from incoming messages
+    char* Topic_Scratch;  // Used when building request topics and channel publish topics
+    RLTopicPool TopicPool;
+    // Internal communication topics to listen to, fixed topics in the topic pool
+    const char* Topic_Response = "";  // Prefix of the response topics used in requests
+    const char* Topic_IdentificationPoll = "";
+    const char* Topic_SetNodeConfig = "";
+    const char* Topic_SetChannelConfig = "";
+    const char* Topic_NodeConfigChanged = "";
+    const char* Topic_Diagnostics = "";
+    // Routing table of incoming topics, RouteSlots holds indices into Routes (-1 for empty slots)
+    RLTopicRoute Routes[MAX_TOPIC_ROUTES];
+    int RouteCount = 0;
+    int8_t RouteSlots[TOPIC_ROUTE_SLOTS];
+    size_t ResponsePrefixLength = 0;  // Length of Topic_Response
+    // JSON documents of JsonSize bytes, owned by RLNodeSized
+    // Used and then cleared for all json structures
+    size_t JsonSize;
+    JsonDocument& JsonDoc;  // Incoming messages
+    JsonDocument& NodeInformation;  // Outgoing messages
     char CorrelationData[MAX_GENERAL_STRING_LENGTH] = "\0";
     int ChannelCount = 0;
-    RLChannel *Channels[MAX_CHANNEL_COUNT];
+    int ChannelCapacity;
+    RLChannel** Channels;
+    uint64_t NextDeadline = 0;  // Earliest NextDueTime among the active channels
+    unsigned long ClockMicros = 0;  // micros() when Clock was updated
+    RLRequest Requests[MAX_QUEUED_REQUESTS];  // Ring buffer of queued requests
+    int RequestHead = 0;
+    int RequestCount = 0;
+    RLExchange* Exchanges;  // Pending exchanges of the first queued request, one per channel
+    bool PipelinedRequests = false;
+    unsigned long ResponseTimeout = MAX_RES_TIME_OUT;
+    unsigned long RetryDelay = REQUEST_RETRY_DELAY;
+    bool ResponseSubscribed = false;
+    int BlockingRequestResult = -1;  // Result of the latest blocking request, -1 while it is pending
+    bool Looping = false;  // In loop(), blocking requests can not be run from its callbacks
+    RLRamSampleStore DefaultStore;
+    RLSampleStore* Store = &DefaultStore;
+    unsigned long StoreDropped = 0;  // Samples lost because the store was full
+    unsigned long LastDrainTime = 0;
+    RLStorage* ConfigCache = NULL;
+    uint8_t Congestion = CONGESTION_NONE;
+    int MaxPriority = 0;  // Highest priority of the active channels, set when the congestion stage changes
+    unsigned long CongestionTime = 0;  // Start of the current congestion interval
+    unsigned int CongestionClear = 0;  // Intervals without congestion in a row
+    unsigned long IntervalPublishes = 0;
+    unsigned long IntervalFailures = 0;
+    unsigned long IntervalLatency = 0;  // Sum of the publish times in us
+    unsigned long FailedSends = 0;  // Publishes failed in a row, only the first one is logged
+    RLMqttSession* Session;
+    RLNodeBase* NextNode = NULL;  // Next node in the session
+    RLNodeBase* NextInBucket = NULL;  // Next node with the same MAC hash in the session
+    unsigned long SessionConnection = 0;  // Connection of the session the subscriptions were made on
+    const char* Subscriptions[MAX_SUBSCRIPTIONS];
+    int SubscriptionCount = 0;
+    bool HasConnected = false;
+    unsigned long DiagnosticsInterval = DIAGNOSTICS_INTERVAL;
+    // Time sync, the epoch time at SyncTime (millis) and the drift of the local clock relative to it
+    unsigned long TimeSyncInterval = TIME_SYNC_INTERVAL;
+    unsigned long LastTimeSyncRequest = 0;
+    RLExchange TimeSync;  // EXCHANGE_RETRY until it is sent, the response is only useful within TIME_SYNC_MAX_ROUND_TRIP
+    void (*TimeSyncCallback)(int result) = NULL;
+    bool TimeSynced = false;
+    unsigned long SyncTime = 0;
+    unsigned long SyncSeconds = 0;
+    unsigned int SyncMilliseconds = 0;
+    int32_t Drift = 0;  // Epoch ms gained per local ms, scaled by 2^32
+    unsigned long LastDiagnosticsTime = 0;
+    unsigned long LastLoopMicros = 0;
+    void (*StartupCallback)(int result) = NULL;
+};
+
+// Node with buffers sized at compile time:
+// room for MaxChannels channels, JSON documents and MQTT buffer of JsonBytes bytes, topics of TopicBytes bytes,
+// and a topic pool of PoolBytes bytes for the node topics and the channel publish topics
+// The default pool holds a publish topic of any length up to MAX_TOPIC_LENGTH for every channel, with four
+// channels the topics take 1044 bytes instead of 1280, getTopicPool().footprint() after the channels are
+// configured shows how much of a smaller PoolBytes would be used
+template <int MaxChannels = MAX_CHANNEL_COUNT, size_t JsonBytes = MAX_JSON_SIZE, size_t TopicBytes = MAX_TOPIC_LENGTH,
+          size_t PoolBytes = TOPIC_POOL_SIZE(MaxChannels)>
+class RLNodeSized : public RLNodeBase
+{
+public:
+    RLNodeSized()
+        : RLNodeBase(ChannelStorage, ExchangeStorage, MaxChannels,
+                     JsonDocStorage, NodeInformationStorage, JsonBytes,
+                     TopicStorage[0], TopicBytes, TopicArena, PoolBytes, TopicEntries, TOPIC_POOL_ENTRIES(MaxChannels))
+    {
+        static_assert(TOPIC_POOL_ENTRIES(MaxChannels) <= TOPIC_POOL_MAX_ENTRIES, "MaxChannels too large for the topic pool");
+    }
+protected:
+    RLChannel* ChannelStorage[MaxChannels];
+    RLExchange ExchangeStorage[MaxChannels];
+    StaticJsonDocument<JsonBytes> JsonDocStorage;
+    StaticJsonDocument<JsonBytes> NodeInformationStorage;
+    char TopicStorage[NODE_TOPIC_COUNT][TopicBytes];
+    char TopicArena[PoolBytes];
+    uint16_t TopicEntries[TOPIC_POOL_ENTRIES(MaxChannels)];
+};
+
+// Node with the default sizes
+typedef RLNodeSized<> RLNode;
+
+// ****************************************************************
+// RLMqttSession class
+// One MQTT connection shared by any number of nodes,
+// incoming messages are routed to the node with the MAC in the topic, other messages to every node handling the topic
+class RLMqttSession
+{
+public:
+    PubSubClient Mqtt;
+    void attach(RLNodeBase* node);  // Called by begin()
+    void detach(RLNodeBase* node);
+    void loop();  // Check for incoming messages, called by loop() of the nodes
+    // Connect with backoff, only one node has to call it for the whole session
+    bool reconnect(const char* id, const char* username, const char* password);
+    int nodeCount() { return NodeCount; }
+    unsigned long Connections = 0;  // Successful connects, nodes subscribe again when it changes
+protected:
+    static void callback(char* topic, byte* payload, unsigned int length);
+    static RLMqttSession* Active;  // Session in loop(), PubSubClient only calls the callback from loop()
+    void route(char* topic, byte* payload, unsigned int length);
+    RLNodeBase* findNode(const char* mac, size_t length);
+    RLNodeBase* Nodes = NULL;  // Attached nodes, linked by NextNode
+    RLNodeBase* Buckets[SESSION_BUCKETS] = {};  // Nodes by MAC hash, linked by NextInBucket
+    int NodeCount = 0;
+    unsigned long NextReconnectTime = 0;
+    int ReconnectAttempts = 0;  // Failed attempts since the connection was lost
 };
 
-extern RLNode logNode;  // Instance of the RLNode to be used
-extern DynamicJsonDocument jsonDoc;
-extern DynamicJsonDocument nodeInformation;
+extern RLMqttSession RLDefaultSession;  // Session of nodes that do not call setSession()
 
-extern PubSubClient mqttClient;
+extern RLNode logNode;  // Default instance of the RLNode, only linked if used
 
-// Reroutes the callback for mqtt subscriptions to the callback in logNode
-void RLNodeMqttCallback(char* topic, byte* payload, unsigned int length);
+extern PubSubClient& mqttClient;  // MQTT client of RLDefaultSession
 
 /* Boiler plate for Arduino Library */
 #endif
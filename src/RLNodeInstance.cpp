@@ -0,0 +1,13 @@
+/**
+ * RLNodeInstance.cpp
+ *
+ * Default instance of the RLNode. Kept in its own file so that it is only
+ * linked into sketches that use logNode, sketches that declare their own
+ * RLNodeSized node do not pay for it.
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "RLNode.h"
+
+RLNode logNode;
@@ -0,0 +1,62 @@
+/**
+ * RLSpscRing.h
+ *
+ * Lock-free ring buffer with one producer and one consumer, such as a timer interrupt and loop().
+ * push() is only called by the producer and pop() only by the consumer, neither of them blocks
+ * or disables interrupts. The indices are single bytes that run freely and are read and written
+ * atomically on every platform, so N must be a power of two of at most 128.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLSpscRing_h
+#define RLSpscRing_h
+
+#include "Arduino.h"
+
+template <class T, uint8_t N>
+class RLSpscRing
+{
+    static_assert(N > 0 && N <= 128 && (N & (N - 1)) == 0, "N must be a power of two of at most 128");
+public:
+    // Producer, returns false and counts the item as dropped if the ring is full
+    bool push(const T& item)
+    {
+        uint8_t head = __atomic_load_n(&Head, __ATOMIC_RELAXED);
+        if ((uint8_t)(head - __atomic_load_n(&Tail, __ATOMIC_ACQUIRE)) >= N)
+        {
+            Dropped++;
+            return false;
+        }
+        Items[head & (N - 1)] = item;
+        __atomic_store_n(&Head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Consumer, returns false if the ring is empty
+    bool pop(T& item)
+    {
+        uint8_t tail = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+        if (tail == __atomic_load_n(&Head, __ATOMIC_ACQUIRE))
+            return false;
+        item = Items[tail & (N - 1)];
+        __atomic_store_n(&Tail, (uint8_t)(tail + 1), __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint8_t count() const
+    {
+        return (uint8_t)(__atomic_load_n(&Head, __ATOMIC_ACQUIRE) - __atomic_load_n(&Tail, __ATOMIC_ACQUIRE));
+    }
+    uint8_t capacity() const { return N; }
+
+    // Written by the producer only, may be read torn on 8-bit boards so it is only used for diagnostics
+    volatile unsigned long Dropped = 0;
+
+protected:
+    T Items[N];
+    uint8_t Head = 0;  // Next item to write, owned by the producer
+    uint8_t Tail = 0;  // Next item to read, owned by the consumer
+};
+
+#endif
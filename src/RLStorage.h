@@ -0,0 +1,167 @@
+/**
+ * RLStorage.h
+ *
+ * Byte addressed storage used by RLNode to keep data in flash, EEPROM or files.
+ * The backends are templates so the library does not depend on a specific
+ * file system or EEPROM implementation.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLStorage_h
+#define RLStorage_h
+
+#include "Arduino.h"
+
+// ****************************************************************
+// Storage interface
+// Reads and writes blocks of bytes at an address in the range [0, size())
+// Backends that buffer writes keep them until flush(), which the configuration cache calls after saving
+// and the sample store never calls, written data can be read back before it is flushed
+class RLStorage
+{
+public:
+    virtual size_t size() = 0;
+    virtual bool read(uint32_t address, void* data, size_t length) = 0;
+    virtual bool write(uint32_t address, const void* data, size_t length) = 0;
+    virtual bool flush() { return true; }
+};
+
+// ****************************************************************
+// File backend
+// Works with any file class that has seek, read, write and flush (SD, LittleFS, SPIFFS, ...)
+// The file must be opened for reading and writing and stay open while in use, it is flushed by flush()
+template <class FileT>
+class RLFileStorage : public RLStorage
+{
+public:
+    RLFileStorage(FileT& file, size_t size) : File(file), Size(size) {}
+    size_t size() { return Size; }
+    bool read(uint32_t address, void* data, size_t length)
+    {
+        if (address + length > Size || !File.seek(address))
+            return false;
+        return (size_t)File.read((uint8_t*)data, length) == length;
+    }
+    bool write(uint32_t address, const void* data, size_t length)
+    {
+        if (address + length > Size || !File.seek(address))
+            return false;
+        return (size_t)File.write((const uint8_t*)data, length) == length;
+    }
+    bool flush()
+    {
+        File.flush();
+        return true;
+    }
+protected:
+    FileT& File;
+    size_t Size;
+};
+
+// ****************************************************************
+// EEPROM backend
+// Works with the EEPROM classes of the Arduino cores, EEPROM must have been started with begin(size)
+// Unchanged bytes are not written. On boards that emulate EEPROM in flash, writes stay in the RAM copy
+// until flush() commits them, so the sample store, which does not survive a reset, never wears the flash
+template <class EepromT>
+class RLEepromStorage : public RLStorage
+{
+public:
+    RLEepromStorage(EepromT& eeprom, size_t size) : Eeprom(eeprom), Size(size) {}
+    size_t size() { return Size; }
+    bool read(uint32_t address, void* data, size_t length)
+    {
+        if (address + length > Size)
+            return false;
+        for (size_t i = 0; i < length; i++)
+            ((uint8_t*)data)[i] = Eeprom.read(address + i);
+        return true;
+    }
+    bool write(uint32_t address, const void* data, size_t length)
+    {
+        if (address + length > Size)
+            return false;
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t b = ((const uint8_t*)data)[i];
+            if (Eeprom.read(address + i) != b)
+            {
+                Eeprom.write(address + i, b);
+                Dirty = true;
+            }
+        }
+        return true;
+    }
+    bool flush()
+    {
+        if (!Dirty)
+            return true;
+        Dirty = false;
+        return commit(Eeprom, 0);
+    }
+protected:
+    // EEPROM emulated in flash has commit(), real EEPROM is written directly
+    template <class T>
+    static auto commit(T& eeprom, int) -> decltype(eeprom.commit()) { return eeprom.commit(); }
+    template <class T>
+    static bool commit(T& eeprom, long) { return true; }
+    EepromT& Eeprom;
+    size_t Size;
+    bool Dirty = false;  // Written since the latest commit
+};
+
+// ****************************************************************
+// Region backend
+// Part of another storage, so one EEPROM or file can hold both the sample store and the configuration cache
+class RLStorageRegion : public RLStorage
+{
+public:
+    RLStorageRegion(RLStorage& storage, uint32_t offset, size_t size) : Storage(storage), Offset(offset), Size(size) {}
+    size_t size() { return Size; }
+    bool read(uint32_t address, void* data, size_t length)
+    {
+        return address + length <= Size && Storage.read(Offset + address, data, length);
+    }
+    bool write(uint32_t address, const void* data, size_t length)
+    {
+        return address + length <= Size && Storage.write(Offset + address, data, length);
+    }
+    bool flush() { return Storage.flush(); }
+protected:
+    RLStorage& Storage;
+    uint32_t Offset;
+    size_t Size;
+};
+
+#ifndef __AVR__
+#include <stdio.h>
+
+// ****************************************************************
+// Host file backend
+// C stdio file, for nodes running on a host (Linux, native test builds), opened with "r+b" or "w+b"
+class RLStdioStorage : public RLStorage
+{
+public:
+    RLStdioStorage(FILE* file, size_t size) : File(file), Size(size) {}
+    size_t size() { return Size; }
+    bool read(uint32_t address, void* data, size_t length)
+    {
+        if (address + length > Size || fseek(File, address, SEEK_SET) != 0)
+            return false;
+        return fread(data, 1, length, File) == length;
+    }
+    bool write(uint32_t address, const void* data, size_t length)
+    {
+        if (address + length > Size || fseek(File, address, SEEK_SET) != 0)
+            return false;
+        return fwrite(data, 1, length, File) == length;
+    }
+    bool flush() { return fflush(File) == 0; }
+protected:
+    FILE* File;
+    size_t Size;
+};
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ * RLTopicPool.cpp
+ *
+ * Owned by: RealTest AB
+ */
+
+#include "RLTopicPool.h"
+
+#define TOPIC_POOL_FREE 0xFFFF
+#define TOPIC_RECORD_HEADER 2  // Parent and users before the text of an entry
+
+void RLTopicPool::clear()
+{
+    Used = 0;
+    FixedUsed = 0;
+    for (int i = 0; i < EntryCount; i++)
+        Entries[i] = TOPIC_POOL_FREE;
+}
+
+const char* RLTopicPool::addFixed(const char* first, const char* second, const char* third)
+{
+    size_t length = strlen(first) + strlen(second) + strlen(third);
+    if (Used != FixedUsed || Used + length + 1 > Size)
+        return NULL;
+    char* topic = Arena + Used;
+    strcpy(topic, first);
+    strcat(topic, second);
+    strcat(topic, third);
+    Used += length + 1;
+    FixedUsed = Used;
+    return topic;
+}
+
+uint8_t RLTopicPool::add(const char* topic)
+{
+    // The prefix is everything up to and including the last '/'
+    const char* slash = strrchr(topic, '/');
+    size_t prefixLength = slash != NULL ? slash - topic + 1 : 0;
+    uint8_t prefix = TOPIC_NONE;
+    if (prefixLength > 0)
+    {
+        prefix = find(TOPIC_NONE, topic, prefixLength);
+        if (prefix == TOPIC_NONE)
+            prefix = insert(TOPIC_NONE, topic, prefixLength);
+        else
+            ((uint8_t*)Arena)[Entries[prefix] + 1]++;
+        if (prefix == TOPIC_NONE)
+            return TOPIC_NONE;
+    }
+
+    const char* suffix = topic + prefixLength;
+    uint8_t entry = find(prefix, suffix, strlen(suffix));
+    if (entry != TOPIC_NONE)
+    {
+        // The topic holds a use of the prefix already
+        ((uint8_t*)Arena)[Entries[entry] + 1]++;
+        if (prefix != TOPIC_NONE)
+            release(prefix);
+        return entry;
+    }
+    entry = insert(prefix, suffix, strlen(suffix));
+    if (entry == TOPIC_NONE && prefix != TOPIC_NONE)
+        release(prefix);
+    return entry;
+}
+
+void RLTopicPool::remove(uint8_t topic)
+{
+    if (topic >= EntryCount || Entries[topic] == TOPIC_POOL_FREE)
+        return;
+    // The prefix is used once by each topic entry, not by each user of the topic
+    uint8_t parent = Arena[Entries[topic]];
+    bool removed = (uint8_t)Arena[Entries[topic] + 1] == 1;
+    release(topic);
+    if (removed && parent != TOPIC_NONE)
+        release(parent);
+}
+
+size_t RLTopicPool::build(uint8_t topic, char* output, size_t size)
+{
+    output[0] = '\0';
+    if (topic >= EntryCount || Entries[topic] == TOPIC_POOL_FREE || size == 0)
+        return 0;
+    uint8_t parent = Arena[Entries[topic]];
+    if (parent != TOPIC_NONE)
+        strncpy(output, Arena + Entries[parent] + TOPIC_RECORD_HEADER, size - 1);
+    output[size - 1] = '\0';
+    size_t length = strlen(output);
+    strncat(output, Arena + Entries[topic] + TOPIC_RECORD_HEADER, size - 1 - length);
+    return strlen(output);
+}
+
+int RLTopicPool::count()
+{
+    int count = 0;
+    for (int i = 0; i < EntryCount; i++)
+        count += Entries[i] != TOPIC_POOL_FREE;
+    return count;
+}
+
+uint8_t RLTopicPool::find(uint8_t parent, const char* text, size_t length)
+{
+    for (int i = 0; i < EntryCount; i++)
+    {
+        if (Entries[i] == TOPIC_POOL_FREE)
+            continue;
+        const char* record = Arena + Entries[i];
+        // Prefixes end in '/' and topics do not, so a prefix and a topic without parent never match
+        if ((uint8_t)record[0] == parent && !strncmp(record + TOPIC_RECORD_HEADER, text, length) &&
+            record[TOPIC_RECORD_HEADER + length] == '\0')
+            return i;
+    }
+    return TOPIC_NONE;
+}
+
+uint8_t RLTopicPool::insert(uint8_t parent, const char* text, size_t length)
+{
+    size_t recordLength = TOPIC_RECORD_HEADER + length + 1;
+    if (Used + recordLength > Size || Used + recordLength > TOPIC_POOL_FREE)
+        return TOPIC_NONE;
+    for (int i = 0; i < EntryCount; i++)
+    {
+        if (Entries[i] != TOPIC_POOL_FREE)
+            continue;
+        char* record = Arena + Used;
+        record[0] = parent;
+        record[1] = 1;
+        memcpy(record + TOPIC_RECORD_HEADER, text, length);
+        record[TOPIC_RECORD_HEADER + length] = '\0';
+        Entries[i] = Used;
+        Used += recordLength;
+        return i;
+    }
+    return TOPIC_NONE;
+}
+
+// Drop one use of an entry, an unused entry is removed and the records after it are moved down
+void RLTopicPool::release(uint8_t entry)
+{
+    char* record = Arena + Entries[entry];
+    if (--((uint8_t*)record)[1] > 0)
+        return;
+    size_t offset = Entries[entry];
+    size_t recordLength = TOPIC_RECORD_HEADER + strlen(record + TOPIC_RECORD_HEADER) + 1;
+    memmove(record, record + recordLength, Used - offset - recordLength);
+    Used -= recordLength;
+    Entries[entry] = TOPIC_POOL_FREE;
+    for (int i = 0; i < EntryCount; i++)
+    {
+        if (Entries[i] != TOPIC_POOL_FREE && Entries[i] > offset)
+            Entries[i] -= recordLength;
+    }
+}
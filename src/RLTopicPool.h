@@ -0,0 +1,58 @@
+/**
+ * RLTopicPool.h
+ *
+ * Topics packed into one arena instead of a buffer of MAX_TOPIC_LENGTH bytes each.
+ *
+ * Fixed topics are added first as whole strings that never move, so they can be subscribed to and
+ * routed by pointer. The other topics are split after their last '/', the prefix is shared by all
+ * topics with the same prefix (e.g. the publish topics of the channels of a node), and the topic is
+ * built into a buffer when it is used. Topics are counted by use and removed when they are no
+ * longer used, the arena is compacted so it never fragments.
+ *
+ * The arena and the entry table are owned by the caller, RLNodeSized sizes both from its channel count.
+ *
+ * Owned by: RealTest AB
+ */
+
+#ifndef RLTopicPool_h
+#define RLTopicPool_h
+
+#include "Arduino.h"
+
+#define TOPIC_POOL_ENTRIES(topics) (2 * (topics))  // Entries for topics that each have their own prefix
+#define TOPIC_POOL_MAX_ENTRIES 0xFF  // Entries are addressed by uint8_t handles below TOPIC_NONE
+#define TOPIC_NONE 0xFF  // Handle of no topic
+
+class RLTopicPool
+{
+public:
+    RLTopicPool(char* arena, size_t size, uint16_t* entries, uint8_t entryCount)
+        : Arena(arena), Size(size), Entries(entries), EntryCount(entryCount) { clear(); }
+    void clear();
+    // Add a topic made of up to three strings that stays in the pool, NULL if it does not fit
+    // Fixed topics can only be added before any other topic
+    const char* addFixed(const char* first, const char* second = "", const char* third = "");
+    // Add a topic, or use a topic already in the pool, returns TOPIC_NONE if it does not fit
+    uint8_t add(const char* topic);
+    void remove(uint8_t topic);
+    // Write the topic into output, returns its length, "" for TOPIC_NONE
+    size_t build(uint8_t topic, char* output, size_t size);
+    size_t used() { return Used; }  // Bytes of the arena in use
+    size_t capacity() { return Size; }
+    size_t footprint() { return Used + EntryCount * sizeof(uint16_t); }  // Bytes used for topics, including the entry table
+    int count();  // Topics and prefixes in the pool, fixed topics not included
+protected:
+    // Entry record in the arena: parent entry (TOPIC_NONE for prefixes and topics without one),
+    // number of users, then the text with a terminating '\0'
+    uint8_t find(uint8_t parent, const char* text, size_t length);
+    uint8_t insert(uint8_t parent, const char* text, size_t length);
+    void release(uint8_t entry);
+    char* Arena;
+    size_t Size;
+    size_t Used = 0;
+    size_t FixedUsed = 0;  // Fixed topics are at the start of the arena
+    uint16_t* Entries;  // Offset of each entry in the arena, 0xFFFF if unused
+    uint8_t EntryCount;
+};
+
+#endif